@@ -0,0 +1,134 @@
+#ifndef UTILBLOCKSTAMP_H
+#define UTILBLOCKSTAMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include "Pattern.h"
+#include "Crc32c.h"
+
+// Self-describing block format. Every STAMP_BLOCK bytes of a buffer start with a
+// BlockStamp that says what was meant to be written there, followed by pattern
+// data. The CRC32C covers the rest of the block, so one CRC checks a block without
+// regenerating anything, and a block that is wrong still tells where it came from.
+#define STAMP_BLOCK 4096
+#define STAMP_MAGIC 0x424D5453u // "STMB"
+
+struct BlockStamp {
+	uint32_t magic;
+	uint32_t crc;     // CRC32C of the block from 'offset' to its end
+	uint64_t offset;  // byte offset the block was written for
+	uint64_t seed;
+	uint32_t pass;
+	uint32_t seq;     // number of the write within its pass
+};
+static_assert(sizeof(BlockStamp) == 32, "block stamp layout");
+
+struct StampFault {
+	size_t start;     // byte offsets [start,end) of the block in the buffer
+	size_t end;
+	std::string kind;
+};
+
+class StampResult {
+public:
+	size_t firstBad;  // offset of the first bad block, or the buffer length
+	std::vector<StampFault> faults;
+	bool truncated = false;
+	bool ok() const { return faults.empty(); }
+	std::string describe() const {
+		std::ostringstream os;
+		for(auto &iter : faults) os << "  bytes " << iter.start << '-' << (iter.end - 1) << ": " << iter.kind << std::endl;
+		if(truncated) os << "  (more bad blocks not shown)" << std::endl;
+		return os.str();
+	}
+};
+
+// Writes and checks stamped buffers for one (seed, pass). The payload is the same
+// PatternGen stream an unstamped buffer would hold, with the stamps written over it.
+class StampedPattern {
+public:
+	StampedPattern(uint64_t seed, uint32_t pass) : seed(seed), pass(pass) { }
+
+	// Fills 'len' bytes meant for 'offset', as write number 'seq' of the pass
+	void fill(char *buf, size_t len, uint64_t offset, uint32_t seq) const {
+		PatternGen(seed, pass, offset).fill(buf, len);
+		for(size_t pos = 0; pos + sizeof(BlockStamp) <= len; pos += STAMP_BLOCK) {
+			size_t blockLen = std::min((size_t)STAMP_BLOCK, len - pos);
+			BlockStamp st = { STAMP_MAGIC, 0, offset + pos, seed, pass, seq };
+			memcpy(buf + pos, &st, sizeof(st));
+			st.crc = Crc32c::compute(buf + pos + 8, blockLen - 8);
+			memcpy(buf + pos + 4, &st.crc, sizeof(st.crc));
+		}
+	}
+
+	// Checks each block of 'len' bytes read from 'offset': one CRC per block, and a description
+	// of what is actually there for the first 'maxFaults' bad ones
+	StampResult check(const char *buf, size_t len, uint64_t offset, size_t maxFaults = 16) const {
+		StampResult res;
+		res.firstBad = len;
+		for(size_t pos = 0; pos < len; pos += STAMP_BLOCK) {
+			size_t blockLen = std::min((size_t)STAMP_BLOCK, len - pos);
+			std::string kind;
+			if(blockOk(buf, pos, blockLen, offset, kind)) continue;
+			if(res.firstBad == len) res.firstBad = pos;
+			if(res.faults.size() == maxFaults) { res.truncated = true; break; }
+			res.faults.push_back({ pos, pos + blockLen, kind });
+		}
+		return res;
+	}
+
+	// Pass numbers are pattern chars in diskSpotcheck; show them that way when they are
+	static std::string passName(uint32_t pass) {
+		if(pass >= 'a' && pass <= 'z') return std::string("pass '") + (char)pass + '\'';
+		return "pass " + std::to_string(pass);
+	}
+
+private:
+	uint64_t seed;
+	uint32_t pass;
+
+	// Checks the block at 'pos' of a buffer read from 'offset'
+	bool blockOk(const char *buf, size_t pos, size_t blockLen, uint64_t offset, std::string &kind) const {
+		const char *block = buf + pos;
+		uint64_t expectOffset = offset + pos;
+		if(blockLen < sizeof(BlockStamp)) {
+			// a tail too short for a stamp holds plain pattern data
+			char expected[sizeof(BlockStamp)];
+			PatternGen(seed, pass, offset).fill(expected, blockLen, pos);
+			if(memcmp(block, expected, blockLen) == 0) return true;
+			kind = "unstamped tail differs";
+			return false;
+		}
+		BlockStamp st;
+		memcpy(&st, block, sizeof(st));
+		bool crcOk = st.magic == STAMP_MAGIC && Crc32c::compute(block + 8, blockLen - 8) == st.crc;
+		if(crcOk && st.offset == expectOffset && st.seed == seed && st.pass == pass) return true;
+		std::ostringstream os;
+		if(st.magic != STAMP_MAGIC) {
+			size_t i = 0;
+			while(i < blockLen && block[i] == block[0]) i++;
+			if(i == blockLen) os << (block[0] == 0 ? "zeroed data" : "a constant fill") << " (no stamp: never written, or lost)";
+			else os << "no stamp: data this tool did not write, or a torn write";
+			kind = os.str();
+			return false;
+		}
+		os << (crcOk ? "" : "corrupted (checksum mismatch) ") << "holds ";
+		if(st.seed != seed) os << "seed " << st.seed << ' ';
+		os << passName(st.pass) << " data for offset " << st.offset << " (write " << st.seq << ')';
+		if(crcOk) {
+			if(st.seed != seed) os << ", left by another run (or another file, in fst)";
+			else if(st.offset != expectOffset) os << ", a misdirected write";
+			else if(st.pass < pass) os << ", stale: this pass's write was lost";
+			else os << ", from a later pass";
+		}
+		kind = os.str();
+		return false;
+	}
+};
+
+#endif
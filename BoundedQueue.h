@@ -0,0 +1,77 @@
+#ifndef UTILBOUNDEDQUEUE_H
+#define UTILBOUNDEDQUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <stddef.h>
+
+// Bounded multi-producer/multi-consumer queue (Vyukov's sequenced ring).
+// Producers and consumers never take a lock; push()/pop() spin and then yield
+// while the queue is full/empty (and sleep briefly once that has gone on for a
+// while), so it is meant for pipeline stages that are all actively working.
+template<typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) {
+		size_t size = 2;
+		while(size < capacity) size <<= 1;
+		mask = size - 1;
+		cells = std::make_unique<Cell[]>(size);
+		for(size_t i = 0; i < size; i++) cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	bool tryPush(const T &val) {
+		size_t pos = tail.load(std::memory_order_relaxed);
+		while(true) {
+			Cell &cell = cells[pos & mask];
+			intptr_t diff = (intptr_t) cell.seq.load(std::memory_order_acquire) - (intptr_t) pos;
+			if(diff == 0) {
+				if(tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.data = val;
+					cell.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) return false;
+			else pos = tail.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool tryPop(T &val) {
+		size_t pos = head.load(std::memory_order_relaxed);
+		while(true) {
+			Cell &cell = cells[pos & mask];
+			intptr_t diff = (intptr_t) cell.seq.load(std::memory_order_acquire) - (intptr_t) (pos + 1);
+			if(diff == 0) {
+				if(head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					val = cell.data;
+					cell.seq.store(pos + mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if(diff < 0) return false;
+			else pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	void push(const T &val) { for(unsigned spin = 0; !tryPush(val); spin++) backoff(spin); }
+	T pop() { T val; for(unsigned spin = 0; !tryPop(val); spin++) backoff(spin); return val; }
+
+private:
+	// a stage stuck behind a slow device for long should not keep a core busy
+	static void backoff(unsigned spin) {
+		if(spin > 4096) std::this_thread::sleep_for(std::chrono::microseconds(50));
+		else if(spin > 64) std::this_thread::yield();
+	}
+
+	struct alignas(64) Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+	alignas(64) std::atomic<size_t> head{0};
+	alignas(64) std::atomic<size_t> tail{0};
+};
+
+#endif
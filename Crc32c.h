@@ -0,0 +1,126 @@
+#ifndef UTILCRC32C_H
+#define UTILCRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// CRC32C (Castagnoli), the checksum iSCSI, ext4 and btrfs use. x86-64 CPUs with
+// SSE4.2 compute it with the crc32 instruction, three independent streams at a
+// time to hide its latency; everything else uses slicing-by-8 tables.
+class Crc32c {
+public:
+	// Continues 'crc' (0 to start) over 'len' bytes of 'buf'
+	static uint32_t update(uint32_t crc, const void *buf, size_t len) {
+#if defined(__x86_64__)
+		static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+		if(hasSse42) return updateHw(crc, (const unsigned char *) buf, len);
+#endif
+		return updateSw(crc, (const unsigned char *) buf, len);
+	}
+	static uint32_t compute(const void *buf, size_t len) { return update(0, buf, len); }
+
+private:
+	static const uint32_t POLY = 0x82F63B78; // reflected Castagnoli polynomial
+
+	struct Tables {
+		uint32_t t[8][256];
+		Tables() {
+			for(uint32_t i = 0; i < 256; i++) {
+				uint32_t crc = i;
+				for(int k = 0; k < 8; k++) crc = (crc >> 1) ^ (POLY & (0 - (crc & 1)));
+				t[0][i] = crc;
+			}
+			for(uint32_t i = 0; i < 256; i++)
+				for(int k = 1; k < 8; k++) t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+		}
+	};
+	static const Tables &tables() { static const Tables tab; return tab; }
+
+	static uint32_t updateSw(uint32_t crc, const unsigned char *buf, size_t len) {
+		const Tables &tab = tables();
+		crc = ~crc;
+		while(len >= 8) {
+			uint64_t w;
+			memcpy(&w, buf, sizeof(w));
+			w ^= crc;
+			crc = tab.t[7][w & 0xFF] ^ tab.t[6][(w >> 8) & 0xFF] ^ tab.t[5][(w >> 16) & 0xFF] ^ tab.t[4][(w >> 24) & 0xFF] ^
+				tab.t[3][(w >> 32) & 0xFF] ^ tab.t[2][(w >> 40) & 0xFF] ^ tab.t[1][(w >> 48) & 0xFF] ^ tab.t[0][w >> 56];
+			buf += 8;
+			len -= 8;
+		}
+		while(len--) crc = (crc >> 8) ^ tab.t[0][(crc ^ *buf++) & 0xFF];
+		return ~crc;
+	}
+
+#if defined(__x86_64__)
+	// Moves a raw CRC register over 'len' zero bytes (zlib's crc32_combine method)
+	static uint32_t shift(uint32_t crc, size_t len) {
+		// multiply by x^(8*len) mod P with square-and-multiply on the GF(2) 32x32 operator
+		uint32_t odd[32], even[32];
+		odd[0] = POLY;
+		for(int i = 1; i < 32; i++) odd[i] = 1u << (i - 1);
+		square(even, odd); // 2 zero bits
+		square(odd, even); // 4 zero bits
+		do {
+			square(even, odd);
+			if(len & 1) crc = times(even, crc);
+			len >>= 1;
+			if(len == 0) break;
+			square(odd, even);
+			if(len & 1) crc = times(odd, crc);
+			len >>= 1;
+		} while(len);
+		return crc;
+	}
+	static uint32_t times(const uint32_t *mat, uint32_t vec) {
+		uint32_t sum = 0;
+		for(int i = 0; vec; i++, vec >>= 1) if(vec & 1) sum ^= mat[i];
+		return sum;
+	}
+	static void square(uint32_t *out, const uint32_t *mat) { for(int i = 0; i < 32; i++) out[i] = times(mat, mat[i]); }
+
+	// Operator that moves a CRC register over one stripe of zero bytes
+	struct StripeShift {
+		uint32_t mat[32];
+		StripeShift() { for(int i = 0; i < 32; i++) mat[i] = shift(1u << i, STRIPE); }
+	};
+	static const size_t STRIPE = 8192; // bytes per stream per round
+
+	// The streams run from a zero register over their own stripe, and by linearity
+	// crc(A||B) = shift(crc(A), |B|) ^ crc0(B), where crc0 starts from zero
+	__attribute__((target("sse4.2")))
+	static uint32_t updateHw(uint32_t crc, const unsigned char *buf, size_t len) {
+		static const StripeShift stripeShift;
+		uint64_t c0 = ~crc;
+		while(len >= 3 * STRIPE) {
+			uint64_t c1 = 0, c2 = 0;
+			for(size_t i = 0; i < STRIPE; i += 8) {
+				uint64_t w0, w1, w2;
+				memcpy(&w0, buf + i, 8);
+				memcpy(&w1, buf + STRIPE + i, 8);
+				memcpy(&w2, buf + 2 * STRIPE + i, 8);
+				c0 = __builtin_ia32_crc32di(c0, w0);
+				c1 = __builtin_ia32_crc32di(c1, w1);
+				c2 = __builtin_ia32_crc32di(c2, w2);
+			}
+			c0 = times(stripeShift.mat, (uint32_t) c0) ^ (uint32_t) c1;
+			c0 = times(stripeShift.mat, (uint32_t) c0) ^ (uint32_t) c2;
+			buf += 3 * STRIPE;
+			len -= 3 * STRIPE;
+		}
+		while(len >= 8) {
+			uint64_t w;
+			memcpy(&w, buf, 8);
+			c0 = __builtin_ia32_crc32di(c0, w);
+			buf += 8;
+			len -= 8;
+		}
+		uint32_t c = (uint32_t) c0;
+		while(len--) c = __builtin_ia32_crc32qi(c, *buf++);
+		return ~c;
+	}
+#endif
+};
+
+#endif
@@ -4,12 +4,31 @@
 // Written by: Fekete Andras 2016
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
 #include <fstream>
+#include <algorithm>
 #include <sys/stat.h>
 #include <linux/fs.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
 
 #define UNUSED(expr) (void)(expr)
 #define likely(x)	__builtin_expect(!!(x), 1)
@@ -28,6 +47,10 @@ public:
 	virtual ssize_t read(char *buf, size_t len, off_t offset) { UNUSED(buf); UNUSED(len); UNUSED(offset); return -1; }
 	virtual ssize_t write(const char *buf, size_t len, off_t offset) { UNUSED(buf); UNUSED(len); UNUSED(offset); return -1; }
 	virtual int flush() { return 0; }
+	// Page cache control, for the files that go through it. dropCache() evicts 'len' bytes at 'offset'
+	// (0 = to the end); cachedPages() counts how many pages of a range are resident.
+	virtual int dropCache(off_t offset, size_t len) { UNUSED(offset); UNUSED(len); errno = ENOTSUP; return -1; }
+	virtual int cachedPages(off_t offset, size_t len, size_t &resident, size_t &total) { UNUSED(offset); UNUSED(len); resident = total = 0; errno = ENOTSUP; return -1; }
 	void getFileInfo(size_t &fileSize, size_t &fileBlockSize) { fileSize = fdSize; fileBlockSize = fdBlockSize; }
 	size_t getSize() { return fdSize; }
 	size_t getBlockSize() { return fdBlockSize; }
@@ -42,7 +65,7 @@ public:
 	explicit FileUnbuffered(const char *filename) : FileUnbuffered(open(filename, O_RDWR | O_LARGEFILE)) {
 		DEBUGPRINTLN("Opening unbuffered file: " << filename);
 	}
-	~FileUnbuffered() override { close(fd); }
+	~FileUnbuffered() override { if(window != nullptr) munmap(window, windowLen); close(fd); }
 protected:
 	FileUnbuffered(int inFd) : File(), fd(inFd) {
 		if(fd == -1) {
@@ -51,6 +74,8 @@ protected:
 			DEBUGPRINTLN("Can't open in file: " << strerror(errno));
 		} else {
 			fdSize = lseek(fd, 0, SEEK_END);
+			struct stat st;
+			isBlockDevice = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
 
 			if (ioctl(fd, BLKBSZGET, &fdBlockSize)) {
 				DEBUGPRINTLN("Can't issue IOCTL to get blocksize. Assuming page size.");
@@ -67,18 +92,61 @@ protected:
 public:
 	ssize_t read(char *buf, size_t len, off_t offset) override {
 		DEBUGPRINTLN("read(" << fd << ',' << len << ',' << offset << ")");
-		if (unlikely(lseek(fd, offset, SEEK_SET) != offset)) { DEBUGPRINTLN("seek error" << strerror(errno)); return -1; }
-		return ::read(fd,buf,len);
+		return ::pread64(fd,buf,len,offset); // positioned, so threads may share the file
 	}
 
 	ssize_t write(const char *buf, size_t len, off_t offset) override {
 		DEBUGPRINTLN("write(" << fd << ',' << len << ',' << offset << ")");
-		if (unlikely(lseek(fd, offset, SEEK_SET) != offset)) { DEBUGPRINTLN("seek error" << strerror(errno)); return -1; }
-		return ::write(fd,buf,len);
+		return ::pwrite64(fd,buf,len,offset);
 	}
 	int flush() override { return fdatasync(fd); }
+
+	// Dirty pages can't be dropped, so they are written first. A whole block device also gets
+	// BLKFLSBUF, which takes its buffer heads along; it needs CAP_SYS_ADMIN, fadvise does not.
+	int dropCache(off_t offset, size_t len) override {
+		if(fdatasync(fd) != 0) return -1;
+		if(isBlockDevice && offset == 0 && (len == 0 || len >= fdSize) && ioctl(fd, BLKFLSBUF, 0) == 0) return 0;
+		int err = posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+		if(err != 0) { errno = err; return -1; }
+		return 0;
+	}
+	// mincore() on a read-only mapping of the range. The mapping is kept for the next call
+	// when it falls in the same 1GB window, so probing many small ranges in offset order is cheap.
+	int cachedPages(off_t offset, size_t len, size_t &resident, size_t &total) override {
+		resident = total = 0;
+		if((uint64_t) offset >= fdSize) return 0;
+		len = std::min<uint64_t>(len, fdSize - offset);
+		const uint64_t page = 4096;
+		uint64_t pos = offset & ~(page - 1), end = offset + len;
+		while(pos < end) {
+			uint64_t start = pos & ~(PROBE_WINDOW - 1);
+			if(window == nullptr || start != (uint64_t) windowStart) {
+				if(window != nullptr) munmap(window, windowLen);
+				windowStart = start;
+				windowLen = std::min<uint64_t>(PROBE_WINDOW, fdSize - start);
+				void *addr = mmap(nullptr, windowLen, PROT_READ, MAP_SHARED, fd, start);
+				if(addr == MAP_FAILED) { window = nullptr; return -1; }
+				window = (char *) addr;
+			}
+			uint64_t stop = std::min<uint64_t>(end, start + windowLen);
+			size_t numPages = (stop - pos + page - 1) / page;
+			probeVec.resize(numPages);
+			if(mincore(window + (pos - start), stop - pos, probeVec.data()) != 0) return -1;
+			for(auto iter : probeVec) resident += iter & 1;
+			total += numPages;
+			pos = start + windowLen;
+		}
+		return 0;
+	}
 protected:
 	int fd;
+	bool isBlockDevice = false;
+private:
+	static const uint64_t PROBE_WINDOW = 1ULL << 30;
+	char *window = nullptr;
+	off_t windowStart = 0;
+	size_t windowLen = 0;
+	std::vector<unsigned char> probeVec;
 };
 
 class FileDirect : public FileUnbuffered {
@@ -101,6 +169,232 @@ public:
 	}
 };
 
+// Asynchronous I/O through io_uring. The file is opened O_DIRECT and registered
+// as a fixed file. prepare() queues a request, submit() hands everything queued
+// to the kernel and reap() collects finished requests; read()/write() are
+// synchronous wrappers and must not be mixed with outstanding async requests.
+class FileIoUring : public FileUnbuffered {
+public:
+	struct Completion { uint64_t tag; int res; };
+
+	explicit FileIoUring(const char *filename, unsigned queueDepth = 32) : FileUnbuffered(open(filename,O_RDWR | O_LARGEFILE | O_DIRECT)) {
+		DEBUGPRINTLN("Opening io_uring file: " << filename << " depth=" << queueDepth);
+		if(fd == -1) return;
+		struct io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		if((ringFd = (int) syscall(__NR_io_uring_setup, queueDepth, &params)) < 0) { DEBUGPRINTLN("io_uring_setup: " << strerror(errno)); fdSize = 0; return; }
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if(params.features & IORING_FEAT_SINGLE_MMAP) sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+		sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqEntries = params.sq_entries;
+		sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+		if(params.features & IORING_FEAT_SINGLE_MMAP) cqRing = sqRing;
+		else cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+		sqes = (struct io_uring_sqe *) mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+		if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) { DEBUGPRINTLN("io_uring mmap: " << strerror(errno)); fdSize = 0; return; }
+		sqTail = (unsigned *)((char *) sqRing + params.sq_off.tail);
+		sqMask = *(unsigned *)((char *) sqRing + params.sq_off.ring_mask);
+		sqArray = (unsigned *)((char *) sqRing + params.sq_off.array);
+		cqHead = (unsigned *)((char *) cqRing + params.cq_off.head);
+		cqTail = (unsigned *)((char *) cqRing + params.cq_off.tail);
+		cqMask = *(unsigned *)((char *) cqRing + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe *)((char *) cqRing + params.cq_off.cqes);
+		depth = std::min(queueDepth, sqEntries);
+#ifdef IORING_FEAT_EXT_ARG
+		timedWait = (params.features & IORING_FEAT_EXT_ARG) != 0;
+#endif
+		if(syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_FILES, &fd, 1) == 0) fixedFile = true;
+		else DEBUGPRINTLN("Can't register fixed file: " << strerror(errno));
+	}
+	~FileIoUring() override {
+		if(sqes != MAP_FAILED && sqes != nullptr) munmap(sqes, sqesSize);
+		if(cqRing != sqRing && cqRing != MAP_FAILED && cqRing != nullptr) munmap(cqRing, cqRingSize);
+		if(sqRing != MAP_FAILED && sqRing != nullptr) munmap(sqRing, sqRingSize);
+		if(ringFd >= 0) close(ringFd);
+	}
+
+	unsigned getQueueDepth() { return depth; }
+	unsigned inFlight() { return queued + submitted; }
+
+	// Registers buffers with the kernel so requests can use READ_FIXED/WRITE_FIXED
+	bool registerBuffers(const struct iovec *iov, unsigned nr) {
+		if(buffersRegistered) syscall(__NR_io_uring_register, ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+		buffersRegistered = (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iov, nr) == 0);
+		if(!buffersRegistered) DEBUGPRINTLN("Can't register buffers: " << strerror(errno));
+		return buffersRegistered;
+	}
+
+	// Queues a request without entering the kernel. 'bufIndex' selects a registered buffer, -1 for none.
+	bool prepare(bool isRead, char *buf, size_t len, off_t offset, uint64_t tag, int bufIndex = -1) {
+		if(unlikely(inFlight() >= depth)) return false;
+		assert((uint64_t)buf % 4096 == 0);
+		assert(len % 4096 == 0);
+		assert(offset % 4096 == 0);
+		unsigned tail = *sqTail;
+		unsigned idx = tail & sqMask;
+		struct io_uring_sqe *sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		if(bufIndex >= 0 && buffersRegistered) {
+			sqe->opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = bufIndex;
+		} else sqe->opcode = isRead ? IORING_OP_READ : IORING_OP_WRITE;
+		if(fixedFile) { sqe->fd = 0; sqe->flags = IOSQE_FIXED_FILE; } else sqe->fd = fd;
+		sqe->addr = (uint64_t) buf;
+		sqe->len = len;
+		sqe->off = offset;
+		sqe->user_data = tag;
+		sqArray[idx] = idx;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		queued++;
+		return true;
+	}
+
+	// Submits queued requests and optionally blocks until 'waitFor' completions are available
+	int submit(unsigned waitFor = 0) {
+		unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+		int ret;
+		while((ret = (int) syscall(__NR_io_uring_enter, ringFd, queued, waitFor, flags, nullptr, 0)) < 0 && errno == EINTR);
+		if(ret < 0) { DEBUGPRINTLN("io_uring_enter: " << strerror(errno)); return -1; }
+		queued -= ret;
+		submitted += ret;
+		return ret;
+	}
+
+	// Like submit(1), but gives up waiting at 'deadline'. Kernels without timed waits
+	// (before 5.11) get a sleep until the deadline instead.
+	int submitUntil(std::chrono::steady_clock::time_point deadline) {
+		auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if(left <= 0 || inFlight() == 0) return submit(0);
+#ifdef IORING_ENTER_EXT_ARG
+		if(timedWait) {
+			struct __kernel_timespec ts = { left / 1000000000, left % 1000000000 };
+			struct io_uring_getevents_arg arg;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t) &ts;
+			int ret;
+			while((ret = (int) syscall(__NR_io_uring_enter, ringFd, queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg))) < 0 && errno == EINTR);
+			if(ret >= 0 || errno == ETIME) {
+				ret = std::max(ret, 0);
+				queued -= ret;
+				submitted += ret;
+				return ret;
+			}
+			if(errno != EINVAL) { DEBUGPRINTLN("io_uring_enter: " << strerror(errno)); return -1; }
+			timedWait = false;
+		}
+#endif
+		int ret = submit(0);
+		if(ret >= 0) std::this_thread::sleep_until(deadline);
+		return ret;
+	}
+
+	// Collects up to 'max' finished requests. 'res' is the byte count or -errno.
+	unsigned reap(Completion *out, unsigned max) {
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		unsigned n = 0;
+		for(; head != tail && n < max; head++, n++) {
+			struct io_uring_cqe *cqe = &cqes[head & cqMask];
+			out[n].tag = cqe->user_data;
+			out[n].res = cqe->res;
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		submitted -= n;
+		return n;
+	}
+
+	ssize_t read(char *buf, size_t len, off_t offset) override { return doSync(true, buf, len, offset); }
+	ssize_t write(const char *buf, size_t len, off_t offset) override { return doSync(false, (char *) buf, len, offset); }
+
+private:
+	ssize_t doSync(bool isRead, char *buf, size_t len, off_t offset) {
+		DEBUGPRINTLN((isRead ? "read(" : "write(") << fd << ',' << len << ',' << offset << ")");
+		Completion c;
+		if(!prepare(isRead, buf, len, offset, 0)) { errno = EBUSY; return -1; }
+		if(submit(1) < 0) return -1;
+		while(reap(&c, 1) == 0) if(submit(1) < 0) return -1;
+		if(c.res < 0) { errno = -c.res; return -1; }
+		return c.res;
+	}
+
+	int ringFd = -1;
+	void *sqRing = nullptr, *cqRing = nullptr;
+	size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0; // known before mapping, so a half-done setup still unmaps
+	struct io_uring_sqe *sqes = nullptr;
+	unsigned *sqTail = nullptr, *sqArray = nullptr, sqMask = 0, sqEntries = 0;
+	unsigned *cqHead = nullptr, *cqTail = nullptr, cqMask = 0;
+	struct io_uring_cqe *cqes = nullptr;
+	unsigned depth = 0, queued = 0, submitted = 0;
+	bool fixedFile = false, buffersRegistered = false, timedWait = false;
+};
+
+// How FileMmap maps the file
+struct MmapOptions {
+	bool populate = false;    // MAP_POPULATE: fault everything in up front
+	int advice = MADV_NORMAL; // madvise() hint for the whole mapping
+	bool syncWrites = false;  // msync() the written range after every write
+	std::string spec = "default";
+
+	// Comma separated: populate, random, sequential, willneed, normal, sync
+	static bool parse(const std::string &spec, MmapOptions &out) {
+		MmapOptions opts;
+		size_t start = 0;
+		while(start <= spec.size()) {
+			size_t end = spec.find(',', start);
+			if(end == std::string::npos) end = spec.size();
+			std::string item = spec.substr(start, end - start);
+			if(item == "populate") opts.populate = true;
+			else if(item == "random") opts.advice = MADV_RANDOM;
+			else if(item == "sequential") opts.advice = MADV_SEQUENTIAL;
+			else if(item == "willneed") opts.advice = MADV_WILLNEED;
+			else if(item == "normal") opts.advice = MADV_NORMAL;
+			else if(item == "sync") opts.syncWrites = true;
+			else return false;
+			start = end + 1;
+		}
+		opts.spec = spec;
+		out = opts;
+		return true;
+	}
+};
+
+// Reads and writes are copies to and from a shared mapping of the whole file,
+// so the I/O itself happens in page faults, readahead and writeback, the way
+// mmap based storage engines do it. flush() is msync().
+class FileMmap : public FileUnbuffered {
+public:
+	explicit FileMmap(const char *filename, const MmapOptions &opts = MmapOptions()) : FileUnbuffered(open(filename, O_RDWR | O_LARGEFILE)), syncWrites(opts.syncWrites) {
+		DEBUGPRINTLN("Opening mmap file: " << filename);
+		if(fdSize == 0) return;
+		void *addr = mmap(nullptr, fdSize, PROT_READ | PROT_WRITE, MAP_SHARED | (opts.populate ? MAP_POPULATE : 0), fd, 0);
+		if(addr == MAP_FAILED) { DEBUGPRINTLN("Can't map file: " << strerror(errno)); fdSize = 0; return; }
+		mem = (char *) addr;
+		if(opts.advice != MADV_NORMAL && madvise(mem, fdSize, opts.advice) != 0) { DEBUGPRINTLN("madvise failed: " << strerror(errno)); }
+	}
+	~FileMmap() override { if(mem != nullptr) munmap(mem, fdSize); }
+
+	// An I/O error while faulting a page in raises SIGBUS rather than failing the call
+	ssize_t read(char *buf, size_t len, off_t offset) override {
+		if(unlikely((uint64_t)(offset+len) > fdSize)) { DEBUGPRINTLN("FileMmap::read(): out of bounds error"); errno = EFAULT; return -1; }
+		memcpy(buf,mem+offset,len);
+		return len;
+	}
+	ssize_t write(const char *buf, size_t len, off_t offset) override {
+		if(unlikely((uint64_t)(offset+len) > fdSize)) { DEBUGPRINTLN("FileMmap::write(): out of bounds error"); errno = EFAULT; return -1; }
+		memcpy(mem+offset,buf,len);
+		if(syncWrites) {
+			off_t start = offset & ~(off_t)4095; // msync wants a page aligned address
+			if(msync(mem + start, len + (offset - start), MS_SYNC) != 0) return -1;
+		}
+		return len;
+	}
+	int flush() override { return msync(mem, fdSize, MS_SYNC); }
+private:
+	char *mem = nullptr;
+	bool syncWrites;
+};
+
 class FileBuffered : public File {
 public:
 	explicit FileBuffered(const char *filename) : File() {
@@ -111,7 +405,8 @@ public:
 		struct stat buf;
 		fstat(fp->_fileno, &buf);
 		if(fdSize < (size_t) buf.st_size) fdSize = buf.st_size;
-		if(fdSize < (size_t) (buf.st_blocks * 512)) fdSize = buf.st_blocks * 512;
+		// allocated blocks only stand in for the size of non-regular files; a regular file may hold more blocks than bytes
+		if(!S_ISREG(buf.st_mode) && fdSize < (size_t) (buf.st_blocks * 512)) fdSize = buf.st_blocks * 512;
 		fdBlockSize = buf.st_blksize;
 	}
 	~FileBuffered() override { fclose(fp); }
@@ -133,14 +428,16 @@ private:
 
 class FileRAM : public File {
 public:
-	explicit FileRAM(size_t size) : File() {
+	// The memory is only reserved: pages are committed when first written and read back as zeros until then
+	explicit FileRAM(size_t size, size_t blockSize = 1) : File() {
 		DEBUGPRINTLN("Opening RAM file with size " << (uint64_t) size);
-		mem = (char *) malloc(size);
-		if(mem == nullptr) { DEBUGPRINTLN("Can't allocate enough memory."); return; }
+		void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(addr == MAP_FAILED) { DEBUGPRINTLN("Can't allocate enough memory."); return; }
+		mem = (char *) addr;
 		fdSize = size;
-		fdBlockSize = 1;
+		fdBlockSize = blockSize;
 	}
-	~FileRAM() override { free(mem); }
+	~FileRAM() override { if(mem != nullptr) munmap(mem, fdSize); }
 
 	ssize_t read(char *buf, size_t len, off_t offset) override {
 		DEBUGPRINTLN("read(" << (uint64_t)mem << ',' << len << ',' << offset << ")");
@@ -155,7 +452,316 @@ public:
 		return len;
 	}
 private:
-	char *mem;
+	char *mem = nullptr;
+};
+
+// Emulated device, opened from a spec such as "emu://size=1T,lat=80us,channels=8",
+// so the tools can run end to end without a real device. The contents are a
+// sparse FileRAM shared by every handle opened with the same spec, for the life
+// of the process. A request occupies one of 'channels' internal channels (128K
+// stripes) for a latency drawn from 'latdist' around 'lat', then moves its data
+// over a bus of 'bw' bytes per second; the caller returns when the request would
+// have completed. 'corrupt' flips a bit in that fraction of reads and 'stale'
+// drops that fraction of writes, so later reads return the old data. Without
+// latency, bandwidth or faults a request is a bounds check and a memcpy.
+class FileEmu : public File {
+public:
+	struct Config {
+		enum LatDist_t { FIXED, EXP, UNIFORM };
+		uint64_t size = 1ULL << 30;
+		size_t blockSize = 4096;
+		uint64_t latNs = 0;
+		LatDist_t latDist = FIXED; // EXP: exponential with mean 'lat', UNIFORM: between 0 and 2*'lat'
+		unsigned channels = 1;
+		double bw = 0;             // bytes per second, 0 is unlimited
+		double corrupt = 0, stale = 0;
+	};
+
+	static bool isSpec(const char *name) { return strncmp(name, "emu://", 6) == 0; }
+
+	// "emu://key=value,...": size, bs (K/M/G/T/P suffixes), lat (ns/us/ms/s, default us),
+	// latdist (fixed, exp, uniform), channels, bw (bytes/s with suffixes), corrupt, stale (fractions)
+	static bool parse(const std::string &spec, Config &out) {
+		if(!isSpec(spec.c_str())) return false;
+		Config cfg;
+		size_t start = 6;
+		while(start < spec.size()) {
+			size_t end = spec.find(',', start);
+			if(end == std::string::npos) end = spec.size();
+			std::string item = spec.substr(start, end - start);
+			start = end + 1;
+			size_t eq = item.find('=');
+			if(eq == std::string::npos) return false;
+			std::string key = item.substr(0, eq);
+			const char *val = item.c_str() + eq + 1;
+			double num;
+			if(key == "latdist") {
+				if(!strcmp(val, "fixed")) cfg.latDist = Config::FIXED;
+				else if(!strcmp(val, "exp")) cfg.latDist = Config::EXP;
+				else if(!strcmp(val, "uniform")) cfg.latDist = Config::UNIFORM;
+				else return false;
+			} else if(key == "lat") {
+				if(!parseNumber(val, num, true) || num < 0) return false;
+				cfg.latNs = num;
+			} else if(key == "size" || key == "bs" || key == "bw") {
+				if(!parseNumber(val, num, false) || num <= 0) return false;
+				if(key == "size") cfg.size = num;
+				else if(key == "bs") cfg.blockSize = num;
+				else cfg.bw = num;
+			} else if(key == "channels" || key == "corrupt" || key == "stale") {
+				char *endNum;
+				num = strtod(val, &endNum);
+				if(endNum == val || *endNum || num < 0) return false;
+				if(key == "channels") { if(num < 1) return false; cfg.channels = num; }
+				else if(num > 1) return false;
+				else if(key == "corrupt") cfg.corrupt = num;
+				else cfg.stale = num;
+			} else return false;
+		}
+		if(cfg.size % cfg.blockSize) return false;
+		out = cfg;
+		return true;
+	}
+
+	// The handle has size 0 if 'spec' is invalid or the memory can't be reserved
+	explicit FileEmu(const char *spec) : File() {
+		DEBUGPRINTLN("Opening emulated device: " << spec);
+		static std::mutex mtx;
+		static std::map<std::string, std::shared_ptr<Device> > devices;
+		std::lock_guard<std::mutex> lock(mtx);
+		std::shared_ptr<Device> &found = devices[spec];
+		if(!found) {
+			Config cfg;
+			if(!parse(spec, cfg)) { DEBUGPRINTLN("Bad emulated device spec: " << spec); errno = EINVAL; devices.erase(spec); return; }
+			found = std::make_shared<Device>(cfg);
+			if(found->ram.getSize() == 0) { errno = ENOMEM; devices.erase(spec); return; }
+		}
+		dev = found;
+		fdSize = dev->ram.getSize();
+		fdBlockSize = dev->ram.getBlockSize();
+	}
+
+	ssize_t read(char *buf, size_t len, off_t offset) override { return access(true, buf, len, offset); }
+	ssize_t write(const char *buf, size_t len, off_t offset) override { return access(false, (char *) buf, len, offset); }
+
+private:
+	struct alignas(64) Channel { std::atomic<uint64_t> busyUntil{0}; };
+	struct Device {
+		explicit Device(const Config &cfg) : cfg(cfg), ram(cfg.size, cfg.blockSize), channels(new Channel[cfg.channels]) { }
+		Config cfg;
+		FileRAM ram;
+		std::unique_ptr<Channel[]> channels;
+		Channel bus;
+	};
+	std::shared_ptr<Device> dev;
+
+	inline ssize_t access(bool isRead, char *buf, size_t len, off_t offset) {
+		Device &d = *dev;
+		const Config &cfg = d.cfg;
+		uint64_t doneNs = 0;
+		if(cfg.latNs || cfg.bw > 0) {
+			doneNs = nowNs();
+			if(cfg.latNs) doneNs = reserve(d.channels[((uint64_t) offset >> 17) % cfg.channels].busyUntil, doneNs, latency(cfg));
+			if(cfg.bw > 0) doneNs = reserve(d.bus.busyUntil, doneNs, len * 1e9 / cfg.bw);
+		}
+		ssize_t res;
+		if(isRead) {
+			res = d.ram.read(buf, len, offset);
+			if(cfg.corrupt > 0 && res > 0 && uniform() < cfg.corrupt) { uint64_t r = nextRandom(); buf[r % len] ^= 1 << (r >> 61); }
+		} else if(cfg.stale > 0 && uniform() < cfg.stale) {
+			res = ((uint64_t)(offset+len) > fdSize) ? (errno = EFAULT, -1) : (ssize_t) len; // acknowledged, never stored
+		} else res = d.ram.write(buf, len, offset);
+		if(doneNs) waitUntil(doneNs);
+		return res;
+	}
+
+	// Books 'durNs' on a resource that is free from 'busyUntil' on, starting no earlier than 'fromNs'; returns the end
+	static inline uint64_t reserve(std::atomic<uint64_t> &busyUntil, uint64_t fromNs, uint64_t durNs) {
+		uint64_t cur = busyUntil.load(std::memory_order_relaxed), end;
+		do { end = std::max(cur, fromNs) + durNs; } while(!busyUntil.compare_exchange_weak(cur, end, std::memory_order_relaxed));
+		return end;
+	}
+	static inline uint64_t latency(const Config &cfg) {
+		switch(cfg.latDist) {
+			case Config::EXP: return -log1p(-uniform()) * cfg.latNs;
+			case Config::UNIFORM: return uniform() * 2 * cfg.latNs;
+			default: return cfg.latNs;
+		}
+	}
+	static inline uint64_t nowNs() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+	// Sleeps while the wait is long, then yields until the deadline
+	static void waitUntil(uint64_t ns) {
+		uint64_t now = nowNs();
+		if(ns > now + 200000) std::this_thread::sleep_for(std::chrono::nanoseconds(ns - now - 100000));
+		while(nowNs() < ns) std::this_thread::yield();
+	}
+	// splitmix64 on a per-thread state, cheap enough for every request
+	static inline uint64_t nextRandom() {
+		static thread_local uint64_t state = nowNs() ^ (uint64_t) &state;
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+	static inline double uniform() { return (nextRandom() >> 11) * (1.0 / 9007199254740992.0); }
+	// A number with an optional binary size suffix (K, M, G, T, P) or, for 'isTime', a time unit giving nanoseconds
+	static bool parseNumber(const char *val, double &out, bool isTime) {
+		char *end;
+		double num = strtod(val, &end);
+		if(end == val) return false;
+		std::string unit = end;
+		if(isTime) {
+			if(unit == "ns") out = num;
+			else if(unit == "us" || unit.empty()) out = num * 1e3;
+			else if(unit == "ms") out = num * 1e6;
+			else if(unit == "s") out = num * 1e9;
+			else return false;
+			return true;
+		}
+		if(!unit.empty() && (unit.back() == 'B' || unit.back() == 'b')) unit.pop_back();
+		static const char *suffixes = "KMGTP";
+		double mult = 1;
+		if(unit.size() == 1) {
+			const char *pos = strchr(suffixes, toupper(unit[0]));
+			if(pos == nullptr) return false;
+			for(const char *i = suffixes; i <= pos; i++) mult *= 1024;
+		} else if(!unit.empty()) return false;
+		out = num * mult;
+		return true;
+	}
+};
+
+// Opens 'name' as a T, or as the emulated device it describes when it is an emu:// spec
+template<class T, class... Args> std::unique_ptr<File> openFile(const char *name, Args&&... args) {
+	if(FileEmu::isSpec(name)) return std::make_unique<FileEmu>(name);
+	return std::make_unique<T>(name, std::forward<Args>(args)...);
+}
+
+// Per-thread source of I/O buffers. Memory is mapped in regions of at least 2MB
+// (hugepage backed after setHugePages(), locked after setLocked()) and cut into
+// slabs of 'count' equal, 4K aligned buffers. A slab belongs to its Slab handle
+// until the handle goes out of scope; a later request of the same size and count
+// then gets it back, so a worker pays for its buffers once and its later phases
+// allocate nothing, while buffers in use are never handed out twice. The calling
+// thread touches the slab first, which places it on its NUMA node. Everything
+// is unmapped when the thread exits.
+class BufferArena {
+public:
+	static const size_t REGION_SIZE = 2 * 1024 * 1024;
+
+	// Move-only handle to the buffers of a slab; returns them to the arena when it goes away
+	class Slab {
+	public:
+		Slab() { }
+		Slab(Slab &&other) noexcept { *this = std::move(other); }
+		Slab &operator=(Slab &&other) noexcept {
+			if(this != &other) {
+				release();
+				std::swap(arena, other.arena);
+				std::swap(base, other.base);
+				bufSize = other.bufSize;
+				count = other.count;
+			}
+			return *this;
+		}
+		Slab(const Slab &) = delete;
+		Slab &operator=(const Slab &) = delete;
+		~Slab() { release(); }
+		char *at(unsigned i) const { return base + i * bufSize; }
+		char *data() const { return base; }
+		size_t bytes() const { return bufSize * count; }
+		explicit operator bool() const { return base != nullptr; }
+	private:
+		friend class BufferArena;
+		void release() {
+			if(arena) arena->release(base);
+			arena = nullptr;
+			base = nullptr;
+		}
+		BufferArena *arena = nullptr;
+		char *base = nullptr;
+		size_t bufSize = 0;
+		unsigned count = 0;
+	};
+
+	// Settings for regions mapped from now on by any thread
+	static void setHugePages(bool enable) { hugePages() = enable; }
+	static void setLocked(bool enable) { locked() = enable; }
+
+	// The calling thread's arena
+	static BufferArena &local() {
+		static thread_local BufferArena arena;
+		return arena;
+	}
+
+	// 'count' buffers of 'bufSize' bytes (rounded up to 4K) back to back; the slab is empty if mapping failed.
+	// The slab must go out of scope on the thread that asked for it, before that thread ends.
+	Slab slab(size_t bufSize, unsigned count = 1) {
+		bufSize = (bufSize + 4095) & ~(size_t) 4095;
+		Slab res;
+		size_t len = bufSize * count;
+		if(len == 0) return res;
+		Extent *found = nullptr;
+		for(auto &iter : extents) if(!iter.inUse && iter.bufSize == bufSize && iter.count == count) { found = &iter; break; }
+		if(found == nullptr) {
+			if(regions.empty() || regions.back().size - regions.back().used < len) {
+				Region region;
+				region.size = (std::max(len, REGION_SIZE) + REGION_SIZE - 1) & ~(REGION_SIZE - 1);
+				if(!mapRegion(region)) return res;
+				regions.push_back(region);
+			}
+			Region &region = regions.back();
+			extents.push_back({ region.mem + region.used, bufSize, count, false });
+			region.used += len;
+			found = &extents.back();
+			memset(found->base, 0, len); // first touch
+		}
+		found->inUse = true;
+		res.arena = this;
+		res.base = found->base;
+		res.bufSize = bufSize;
+		res.count = count;
+		return res;
+	}
+
+	BufferArena(const BufferArena &) = delete;
+	BufferArena &operator=(const BufferArena &) = delete;
+	~BufferArena() { for(auto &iter : regions) munmap(iter.mem, iter.size); }
+
+private:
+	struct Region { char *mem = nullptr; size_t size = 0; size_t used = 0; };
+	struct Extent { char *base; size_t bufSize; unsigned count; bool inUse; };
+
+	BufferArena() { }
+
+	void release(char *base) { for(auto &iter : extents) if(iter.base == base) iter.inUse = false; }
+
+	static bool &hugePages() { static bool enable = false; return enable; }
+	static bool &locked() { static bool enable = false; return enable; }
+
+	static bool mapRegion(Region &region) {
+		void *mem = MAP_FAILED;
+		if(hugePages()) mem = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(mem == MAP_FAILED) {
+			// no reserved hugepages: ask for transparent ones instead, which only back 2MB aligned ranges
+			size_t extra = hugePages() ? REGION_SIZE : 0;
+			mem = mmap(nullptr, region.size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(mem == MAP_FAILED) { DEBUGPRINTLN("BufferArena: can't map " << region.size << " bytes: " << strerror(errno)); return false; }
+			if(extra) {
+				char *start = (char *) mem, *aligned = (char *)(((uintptr_t) start + REGION_SIZE - 1) & ~(uintptr_t)(REGION_SIZE - 1));
+				if(aligned > start) munmap(start, aligned - start);
+				if(aligned + region.size < start + region.size + extra) munmap(aligned + region.size, start + extra - aligned);
+				mem = aligned;
+				madvise(mem, region.size, MADV_HUGEPAGE);
+			}
+		}
+		if(locked() && mlock(mem, region.size) != 0) { DEBUGPRINTLN("BufferArena: can't lock memory: " << strerror(errno)); }
+		region.mem = (char *) mem;
+		return true;
+	}
+
+	std::vector<Region> regions;
+	std::vector<Extent> extents;
 };
 
 #endif
@@ -0,0 +1,115 @@
+#ifndef UTILHISTOGRAM_H
+#define UTILHISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+
+// Log-linear latency histogram in the style of HdrHistogram: every power of two
+// is split into 2^SUB_BITS linear buckets, giving < 1% relative error from 1ns
+// up to MAX_BITS. Storage is a fixed array, so record() never allocates; each
+// worker thread owns its own histogram and they are merged afterwards.
+// Counters are single-writer relaxed atomics (plain loads/stores on x86), so
+// a sampler thread may read a histogram while its owner is still recording.
+class LatencyHistogram {
+public:
+	static const unsigned SUB_BITS = 7;
+	static const unsigned SUB = 1u << SUB_BITS;
+	static const unsigned MAX_BITS = 40; // ~18 minutes in ns
+	static const unsigned NUM_BUCKETS = (MAX_BITS - SUB_BITS + 2) * SUB;
+
+	LatencyHistogram() { reset(); }
+
+	void reset() {
+		for(unsigned i = 0; i < NUM_BUCKETS; i++) buckets[i].store(0, std::memory_order_relaxed);
+		total.store(0); sum.store(0); minVal.store(UINT64_MAX); maxVal.store(0);
+	}
+
+	// Only the owning thread may call record()
+	inline void record(uint64_t ns) {
+		bump(buckets[bucketOf(ns)], 1);
+		bump(total, 1);
+		bump(sum, ns);
+		if(ns < minVal.load(std::memory_order_relaxed)) minVal.store(ns, std::memory_order_relaxed);
+		if(ns > maxVal.load(std::memory_order_relaxed)) maxVal.store(ns, std::memory_order_relaxed);
+	}
+
+	void merge(const LatencyHistogram &other) {
+		for(unsigned i = 0; i < NUM_BUCKETS; i++) bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+		bump(total, other.total.load(std::memory_order_relaxed));
+		bump(sum, other.sum.load(std::memory_order_relaxed));
+		if(other.minVal.load() < minVal.load()) minVal.store(other.minVal.load());
+		if(other.maxVal.load() > maxVal.load()) maxVal.store(other.maxVal.load());
+	}
+
+	// Adds what 'cur' recorded since 'last' was taken, then updates 'last' to 'cur'.
+	// Min/max of the interval are only known to bucket precision.
+	void mergeSince(const LatencyHistogram &cur, LatencyHistogram &last) {
+		for(unsigned i = 0; i < NUM_BUCKETS; i++) {
+			uint64_t now = cur.buckets[i].load(std::memory_order_relaxed);
+			uint64_t delta = now - last.buckets[i].load(std::memory_order_relaxed);
+			if(delta == 0) continue;
+			last.buckets[i].store(now, std::memory_order_relaxed);
+			bump(buckets[i], delta);
+			bump(total, delta);
+			bump(sum, delta * highestOf(i));
+			uint64_t lowest = i < SUB ? i : highestOf(i - 1) + 1;
+			if(lowest < minVal.load()) minVal.store(lowest);
+			if(highestOf(i) > maxVal.load()) maxVal.store(highestOf(i));
+		}
+	}
+
+	uint64_t count() const { return total.load(std::memory_order_relaxed); }
+	uint64_t min() const { return count() ? minVal.load(std::memory_order_relaxed) : 0; }
+	uint64_t max() const { return maxVal.load(std::memory_order_relaxed); }
+	double mean() const { return count() ? (double) sum.load(std::memory_order_relaxed) / count() : 0; }
+
+	// Smallest recorded value such that 'pct' percent of the samples are at or below it
+	uint64_t percentile(double pct) const {
+		if(count() == 0) return 0;
+		uint64_t target = (uint64_t)(pct / 100.0 * count() + 0.5);
+		if(target == 0) target = 1;
+		uint64_t seen = 0;
+		for(unsigned i = 0; i < NUM_BUCKETS; i++) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if(seen >= target) return std::min(std::max(highestOf(i), min()), max());
+		}
+		return max();
+	}
+
+	// "min=.. p50=.. p90=.. p99=.. p99.9=.. p99.99=.. max=.." in microseconds
+	std::string summary() const {
+		std::ostringstream os;
+		os << "min=" << min() / 1000.0 << "us p50=" << percentile(50) / 1000.0 << "us p90=" << percentile(90) / 1000.0
+		   << "us p99=" << percentile(99) / 1000.0 << "us p99.9=" << percentile(99.9) / 1000.0 << "us p99.99=" << percentile(99.99) / 1000.0
+		   << "us max=" << max() / 1000.0 << "us";
+		return os.str();
+	}
+
+	static inline unsigned bucketOf(uint64_t ns) {
+		if(ns < SUB) return (unsigned) ns;
+		unsigned msb = 63 - __builtin_clzll(ns);
+		if(msb > MAX_BITS) return NUM_BUCKETS - 1;
+		unsigned shift = msb - SUB_BITS;
+		return (shift + 1) * SUB + (unsigned)((ns >> shift) - SUB);
+	}
+	static inline uint64_t highestOf(unsigned idx) {
+		if(idx < SUB) return idx;
+		unsigned shift = idx / SUB - 1;
+		return (((uint64_t) SUB + idx % SUB + 1) << shift) - 1;
+	}
+
+private:
+	static inline void bump(std::atomic<uint64_t> &counter, uint64_t val) { counter.store(counter.load(std::memory_order_relaxed) + val, std::memory_order_relaxed); }
+
+	std::atomic<uint64_t> buckets[NUM_BUCKETS];
+	std::atomic<uint64_t> total;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> minVal;
+	std::atomic<uint64_t> maxVal;
+};
+
+#endif
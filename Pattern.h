@@ -0,0 +1,85 @@
+#ifndef UTILPATTERN_H
+#define UTILPATTERN_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// Counter-based data generator. Word 'i' of a stream is a pure function of the
+// stream key and 'i' (SplitMix64 applied to a Weyl sequence), so any part of
+// any stream can be regenerated independently, in any order, on any thread.
+// The key is derived from (seed, pass, location), giving every location of
+// every pass its own contents.
+class PatternGen {
+public:
+	PatternGen(uint64_t seed, uint64_t pass, uint64_t location) : key(mix(mix(mix(seed) ^ pass) ^ location)) { }
+
+	static inline uint64_t mix(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	inline uint64_t word(uint64_t idx) const { return mix(key + (idx + 1) * 0x9e3779b97f4a7c15ULL); }
+
+	// Uniform value in [0,1) taken from word 'idx'
+	inline double fraction(uint64_t idx) const { return (word(idx) >> 11) * (1.0 / 9007199254740992.0); }
+
+	// Fills 'buf' with bytes [offset, offset+len) of the stream
+	void fill(char *buf, size_t len, uint64_t offset = 0) const {
+		size_t head = headLen(len, offset);
+		if(head) {
+			uint64_t w = word(offset / 8);
+			memcpy(buf, (const char *) &w + offset % 8, head);
+			buf += head;
+			len -= head;
+			offset += head;
+		}
+		uint64_t first = offset / 8;
+		size_t numWords = len / 8;
+		for(size_t i = 0; i < numWords; i++) {
+			uint64_t w = word(first + i);
+			memcpy(buf + i * 8, &w, sizeof(w));
+		}
+		if(len % 8) {
+			uint64_t w = word(first + numWords);
+			memcpy(buf + numWords * 8, &w, len % 8);
+		}
+	}
+
+	// Position of the first byte of 'buf' that differs from bytes [offset, offset+len) of the
+	// stream, or 'len' if none does. Compares as it generates, so no expected buffer is needed.
+	size_t mismatch(const char *buf, size_t len, uint64_t offset = 0) const {
+		size_t head = headLen(len, offset);
+		if(head) {
+			uint64_t w = word(offset / 8);
+			const char *expected = (const char *) &w + offset % 8;
+			for(size_t j = 0; j < head; j++) if(buf[j] != expected[j]) return j;
+			return head + mismatch(buf + head, len - head, offset + head);
+		}
+		uint64_t first = offset / 8;
+		size_t numWords = len / 8;
+		for(size_t i = 0; i < numWords; i++) {
+			uint64_t w = word(first + i), got;
+			memcpy(&got, buf + i * 8, sizeof(got));
+			if(got != w) return i * 8 + firstDiff(buf + i * 8, w, 8);
+		}
+		if(len % 8) return numWords * 8 + firstDiff(buf + numWords * 8, word(first + numWords), len % 8);
+		return len;
+	}
+
+private:
+	// Bytes before the next word boundary of the stream, when 'offset' is not on one
+	static inline size_t headLen(size_t len, uint64_t offset) { return offset % 8 ? (len < 8 - offset % 8 ? len : 8 - offset % 8) : 0; }
+
+	static inline size_t firstDiff(const char *buf, uint64_t w, size_t len) {
+		const char *expected = (const char *) &w;
+		size_t j = 0;
+		while(j < len && buf[j] == expected[j]) j++;
+		return j;
+	}
+
+	uint64_t key;
+};
+
+#endif
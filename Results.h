@@ -0,0 +1,387 @@
+#ifndef UTILRESULTS_H
+#define UTILRESULTS_H
+
+#include <stdint.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+#include <utility>
+#include <stdlib.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <iostream>
+
+// Machine-readable results shared by the tools. A run is written as
+//   { "tool": .., "config": {..}, "phases": [ { "name": .., "metrics": { <metric>: {..} } } ], "errors": [..] }
+// where every metric is { "value": x, "unit": .., "higher_is_better": b, "samples": [..] }.
+// compareBaseline() matches phases by name and flags metrics that got worse.
+
+class JsonValue {
+public:
+	typedef enum { JSON_NULL, JSON_BOOL, JSON_NUMBER, JSON_STRING, JSON_ARRAY, JSON_OBJECT } Type_t;
+
+	JsonValue() : type(JSON_NULL) { }
+	JsonValue(bool val) : type(JSON_BOOL), boolVal(val) { }
+	JsonValue(double val) : type(JSON_NUMBER), numVal(val) { }
+	JsonValue(int val) : type(JSON_NUMBER), numVal(val) { }
+	JsonValue(unsigned val) : type(JSON_NUMBER), numVal(val) { }
+	JsonValue(uint64_t val) : type(JSON_NUMBER), numVal((double) val) { }
+	JsonValue(int64_t val) : type(JSON_NUMBER), numVal((double) val) { }
+	JsonValue(const std::string &val) : type(JSON_STRING), strVal(val) { }
+	JsonValue(const char *val) : type(JSON_STRING), strVal(val) { }
+	static JsonValue array() { JsonValue v; v.type = JSON_ARRAY; return v; }
+	static JsonValue object() { JsonValue v; v.type = JSON_OBJECT; return v; }
+
+	Type_t getType() const { return type; }
+	double number() const { return type == JSON_NUMBER ? numVal : (type == JSON_BOOL ? boolVal : 0); }
+	bool boolean() const { return type == JSON_BOOL ? boolVal : number() != 0; }
+	const std::string &str() const { return strVal; }
+	size_t size() const { return type == JSON_ARRAY ? arrVal.size() : objVal.size(); }
+	const JsonValue &at(size_t i) const { return arrVal[i]; }
+	const std::vector<std::pair<std::string, JsonValue>> &members() const { return objVal; }
+
+	void push(const JsonValue &val) { type = JSON_ARRAY; arrVal.push_back(val); }
+	JsonValue &operator[](const std::string &key) {
+		type = JSON_OBJECT;
+		for(auto &iter : objVal) if(iter.first == key) return iter.second;
+		objVal.emplace_back(key, JsonValue());
+		return objVal.back().second;
+	}
+	const JsonValue *find(const std::string &key) const {
+		for(auto &iter : objVal) if(iter.first == key) return &iter.second;
+		return nullptr;
+	}
+
+	void write(std::ostream &os, unsigned indent = 0) const {
+		std::string pad(indent, '\t'), padIn(indent + 1, '\t');
+		switch(type) {
+			case JSON_NULL: os << "null"; break;
+			case JSON_BOOL: os << (boolVal ? "true" : "false"); break;
+			case JSON_NUMBER:
+				if(std::isfinite(numVal)) os << std::setprecision(15) << numVal; else os << "null";
+				break;
+			case JSON_STRING: writeString(os, strVal); break;
+			case JSON_ARRAY: {
+					bool flat = true;
+					for(auto &iter : arrVal) if(iter.type == JSON_ARRAY || iter.type == JSON_OBJECT) flat = false;
+					os << '[';
+					for(size_t i = 0; i < arrVal.size(); i++) {
+						if(i) os << ',';
+						if(!flat) os << std::endl << padIn;
+						arrVal[i].write(os, indent + 1);
+					}
+					if(!flat && arrVal.size()) os << std::endl << pad;
+					os << ']';
+				}
+				break;
+			case JSON_OBJECT:
+				os << '{';
+				for(size_t i = 0; i < objVal.size(); i++) {
+					os << (i ? "," : "") << std::endl << padIn;
+					writeString(os, objVal[i].first);
+					os << ": ";
+					objVal[i].second.write(os, indent + 1);
+				}
+				if(objVal.size()) os << std::endl << pad;
+				os << '}';
+				break;
+		}
+	}
+
+	// Parses 'text' into 'out'. Returns false and sets 'err' on malformed input.
+	static bool parse(const std::string &text, JsonValue &out, std::string &err) {
+		size_t pos = 0;
+		if(!parseValue(text, pos, out, err)) return false;
+		skipSpace(text, pos);
+		if(pos != text.size()) { err = "trailing characters"; return false; }
+		return true;
+	}
+
+private:
+	static void writeString(std::ostream &os, const std::string &val) {
+		os << '"';
+		for(char c : val) {
+			switch(c) {
+				case '"': os << "\\\""; break;
+				case '\\': os << "\\\\"; break;
+				case '\n': os << "\\n"; break;
+				case '\t': os << "\\t"; break;
+				default:
+					if((unsigned char) c < 0x20) os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec << std::setfill(' ');
+					else os << c;
+			}
+		}
+		os << '"';
+	}
+	static void skipSpace(const std::string &text, size_t &pos) { while(pos < text.size() && isspace((unsigned char) text[pos])) pos++; }
+	static bool parseString(const std::string &text, size_t &pos, std::string &out, std::string &err) {
+		out.clear();
+		pos++; // opening quote
+		while(pos < text.size() && text[pos] != '"') {
+			if(text[pos] == '\\' && pos + 1 < text.size()) {
+				pos++;
+				switch(text[pos]) {
+					case 'n': out += '\n'; break;
+					case 't': out += '\t'; break;
+					case 'r': out += '\r'; break;
+					case 'b': out += '\b'; break;
+					case 'f': out += '\f'; break;
+					case 'u':
+						if(pos + 4 >= text.size()) { err = "bad escape"; return false; }
+						out += (char) strtol(text.substr(pos + 1, 4).c_str(), nullptr, 16);
+						pos += 4;
+						break;
+					default: out += text[pos];
+				}
+			} else out += text[pos];
+			pos++;
+		}
+		if(pos >= text.size()) { err = "unterminated string"; return false; }
+		pos++;
+		return true;
+	}
+	static bool parseValue(const std::string &text, size_t &pos, JsonValue &out, std::string &err) {
+		skipSpace(text, pos);
+		if(pos >= text.size()) { err = "unexpected end of input"; return false; }
+		char c = text[pos];
+		if(c == '{') {
+			out = object();
+			pos++;
+			skipSpace(text, pos);
+			if(pos < text.size() && text[pos] == '}') { pos++; return true; }
+			while(true) {
+				skipSpace(text, pos);
+				if(pos >= text.size() || text[pos] != '"') { err = "expected key"; return false; }
+				std::string key;
+				if(!parseString(text, pos, key, err)) return false;
+				skipSpace(text, pos);
+				if(pos >= text.size() || text[pos] != ':') { err = "expected ':'"; return false; }
+				pos++;
+				JsonValue val;
+				if(!parseValue(text, pos, val, err)) return false;
+				out.objVal.emplace_back(key, val);
+				skipSpace(text, pos);
+				if(pos < text.size() && text[pos] == ',') { pos++; continue; }
+				if(pos < text.size() && text[pos] == '}') { pos++; return true; }
+				err = "expected ',' or '}'";
+				return false;
+			}
+		}
+		if(c == '[') {
+			out = array();
+			pos++;
+			skipSpace(text, pos);
+			if(pos < text.size() && text[pos] == ']') { pos++; return true; }
+			while(true) {
+				JsonValue val;
+				if(!parseValue(text, pos, val, err)) return false;
+				out.arrVal.push_back(val);
+				skipSpace(text, pos);
+				if(pos < text.size() && text[pos] == ',') { pos++; continue; }
+				if(pos < text.size() && text[pos] == ']') { pos++; return true; }
+				err = "expected ',' or ']'";
+				return false;
+			}
+		}
+		if(c == '"') { out = JsonValue(""); return parseString(text, pos, out.strVal, err); }
+		if(text.compare(pos, 4, "true") == 0) { out = JsonValue(true); pos += 4; return true; }
+		if(text.compare(pos, 5, "false") == 0) { out = JsonValue(false); pos += 5; return true; }
+		if(text.compare(pos, 4, "null") == 0) { out = JsonValue(); pos += 4; return true; }
+		char *end;
+		double val = strtod(text.c_str() + pos, &end);
+		if(end == text.c_str() + pos) { err = "unexpected character"; return false; }
+		pos = end - text.c_str();
+		out = JsonValue(val);
+		return true;
+	}
+
+	Type_t type;
+	bool boolVal = false;
+	double numVal = 0;
+	std::string strVal;
+	std::vector<JsonValue> arrVal;
+	std::vector<std::pair<std::string, JsonValue>> objVal;
+};
+
+inline JsonValue makeMetric(double value, const char *unit, bool higherIsBetter, const std::vector<double> &samples = std::vector<double>()) {
+	JsonValue metric = JsonValue::object();
+	metric["value"] = value;
+	metric["unit"] = unit;
+	metric["higher_is_better"] = higherIsBetter;
+	JsonValue arr = JsonValue::array();
+	for(double iter : samples) arr.push(iter);
+	metric["samples"] = arr;
+	return metric;
+}
+
+inline JsonValue makeResults(const char *tool, int argc, char *argv[]) {
+	JsonValue root = JsonValue::object();
+	root["tool"] = tool;
+	std::string cmdLine;
+	for(int i = 0; i < argc; i++) { if(i) cmdLine += ' '; cmdLine += argv[i]; }
+	root["command"] = cmdLine;
+	root["config"] = JsonValue::object();
+	root["phases"] = JsonValue::array();
+	root["errors"] = JsonValue::array();
+	return root;
+}
+
+inline bool writeResults(const std::string &path, const JsonValue &root) {
+	std::ofstream out(path, std::ofstream::out | std::ofstream::trunc);
+	if(!out.is_open()) return false;
+	root.write(out);
+	out << std::endl;
+	return out.good();
+}
+
+inline bool readResults(const std::string &path, JsonValue &root, std::string &err) {
+	std::ifstream in(path);
+	if(!in.is_open()) { err = "can't open " + path; return false; }
+	std::stringstream text;
+	text << in.rdbuf();
+	return JsonValue::parse(text.str(), root, err);
+}
+
+// One-sided 95% critical values of Student's t for 1..30 degrees of freedom
+inline double tCritical95(double df) {
+	static const double table[] = { 6.314, 2.920, 2.353, 2.132, 2.015, 1.943, 1.895, 1.860, 1.833, 1.812, 1.796, 1.782, 1.771, 1.761, 1.753,
+		1.746, 1.740, 1.734, 1.729, 1.725, 1.721, 1.717, 1.714, 1.711, 1.708, 1.706, 1.703, 1.701, 1.699, 1.697 };
+	if(df < 1) return table[0];
+	if(df > 30) return 1.645;
+	return table[(int) df - 1];
+}
+
+inline void meanVar(const JsonValue &samples, double &mean, double &var) {
+	mean = 0; var = 0;
+	size_t n = samples.size();
+	for(size_t i = 0; i < n; i++) mean += samples.at(i).number();
+	mean /= n;
+	for(size_t i = 0; i < n; i++) var += (samples.at(i).number() - mean) * (samples.at(i).number() - mean);
+	var /= (n - 1);
+}
+
+// A metric is usable for comparison when it has a numeric value and says which direction is better
+inline bool validMetric(const JsonValue &metric) {
+	const JsonValue *value = metric.find("value");
+	const JsonValue *higherBetter = metric.find("higher_is_better");
+	return value && value->getType() == JsonValue::JSON_NUMBER && higherBetter && higherBetter->getType() == JsonValue::JSON_BOOL;
+}
+
+inline bool validSamples(const JsonValue *samples) {
+	return samples && samples->getType() == JsonValue::JSON_ARRAY && samples->size() >= 2;
+}
+
+// Compares 'current' against the results stored in 'baselinePath'. A metric regresses when it is more than
+// 'tolerancePct' worse and a one-sided Welch's t-test on the samples of both runs says the drop is significant.
+// Metrics with fewer than two samples on either side are reported but never fail the comparison.
+// Returns 1 on regression, 0 if none, -1 if the baseline can't be read or was written by another tool.
+inline int compareBaseline(const JsonValue &current, const std::string &baselinePath, double tolerancePct, std::ostream &report) {
+	JsonValue baseline;
+	std::string err;
+	if(!readResults(baselinePath, baseline, err)) { report << "Can't read baseline " << baselinePath << ": " << err << std::endl; return -1; }
+	const JsonValue *curTool = current.find("tool");
+	const JsonValue *baseTool = baseline.find("tool");
+	if(curTool == nullptr || baseTool == nullptr || curTool->str() != baseTool->str()) {
+		report << "Baseline " << baselinePath << " was written by " << (baseTool ? baseTool->str() : std::string("an unknown tool"))
+		       << ", not " << (curTool ? curTool->str() : std::string("this tool")) << std::endl;
+		return -1;
+	}
+	const JsonValue *curPhases = current.find("phases");
+	const JsonValue *basePhases = baseline.find("phases");
+	if(curPhases == nullptr || basePhases == nullptr || curPhases->getType() != JsonValue::JSON_ARRAY || basePhases->getType() != JsonValue::JSON_ARRAY) {
+		report << "Baseline has no phases" << std::endl;
+		return -1;
+	}
+	int regressions = 0;
+	std::vector<bool> used(basePhases->size(), false);
+	for(size_t p = 0; p < curPhases->size(); p++) {
+		const JsonValue &cur = curPhases->at(p);
+		const JsonValue *curName = cur.find("name");
+		if(curName == nullptr || curName->getType() != JsonValue::JSON_STRING) { report << "  phase " << p << ": no name, skipped" << std::endl; continue; }
+		const std::string &name = curName->str();
+		const JsonValue *base = nullptr;
+		for(size_t b = 0; b < basePhases->size() && base == nullptr; b++) {
+			const JsonValue *baseName = basePhases->at(b).find("name");
+			if(!used[b] && baseName && baseName->str() == name) { used[b] = true; base = &basePhases->at(b); }
+		}
+		if(base == nullptr) { report << "  " << name << ": not in baseline" << std::endl; continue; }
+		const JsonValue *curMetrics = cur.find("metrics");
+		const JsonValue *baseMetrics = base->find("metrics");
+		if(curMetrics == nullptr || baseMetrics == nullptr) continue;
+		for(auto &iter : curMetrics->members()) {
+			const JsonValue *baseMetric = baseMetrics->find(iter.first);
+			if(baseMetric == nullptr) continue;
+			if(!validMetric(iter.second) || !validMetric(*baseMetric)) { report << "  " << name << ' ' << iter.first << ": malformed metric, skipped" << std::endl; continue; }
+			double curVal = iter.second.find("value")->number();
+			double baseVal = baseMetric->find("value")->number();
+			bool higherBetter = iter.second.find("higher_is_better")->boolean();
+			const JsonValue *unitVal = iter.second.find("unit");
+			std::string unit = unitVal ? unitVal->str() : std::string();
+			if(baseVal == 0) continue;
+			double worsePct = (higherBetter ? (baseVal - curVal) : (curVal - baseVal)) / fabs(baseVal) * 100;
+			if(worsePct <= tolerancePct) continue;
+			const JsonValue *curSamples = iter.second.find("samples");
+			const JsonValue *baseSamples = baseMetric->find("samples");
+			if(!validSamples(curSamples) || !validSamples(baseSamples)) {
+				report << "  worse " << name << ' ' << iter.first << ": " << baseVal << " -> " << curVal << ' ' << unit
+				       << " (" << worsePct << "% worse, too few samples to test)" << std::endl;
+				continue;
+			}
+			double m1, v1, m2, v2;
+			meanVar(*curSamples, m1, v1);
+			meanVar(*baseSamples, m2, v2);
+			double n1 = curSamples->size(), n2 = baseSamples->size();
+			double se2 = v1 / n1 + v2 / n2;
+			double delta = higherBetter ? m2 - m1 : m1 - m2;
+			// without any spread the sign of the difference decides on its own
+			double t = se2 > 0 ? delta / sqrt(se2) : (delta > 0 ? INFINITY : (delta < 0 ? -INFINITY : 0));
+			double df = se2 > 0 ? se2 * se2 / ((v1 / n1) * (v1 / n1) / (n1 - 1) + (v2 / n2) * (v2 / n2) / (n2 - 1)) : 1;
+			bool significant = t > tCritical95(df);
+			if(significant) regressions++;
+			report << (significant ? "  REGRESSION " : "  worse ") << name << ' ' << iter.first << ": " << baseVal << " -> " << curVal << ' ' << unit
+			       << " (" << worsePct << "% worse, t=" << t << " df=" << df << (significant ? ")" : ", not significant)") << std::endl;
+		}
+	}
+	report << (regressions ? "Regressions against baseline: " : "No regressions against baseline ") << (regressions ? std::to_string(regressions) : baselinePath) << std::endl;
+	return regressions ? 1 : 0;
+}
+
+// The --json/--baseline/--tolerance options every tool takes. A tool lists RESULTS_LONG_OPTIONS first in its
+// option table and numbers its own long options from OPT_RESULTS_END.
+enum { OPT_JSON = 256, OPT_BASELINE, OPT_TOLERANCE, OPT_RESULTS_END };
+#define RESULTS_LONG_OPTIONS \
+	{ "json", required_argument, nullptr, OPT_JSON }, \
+	{ "baseline", required_argument, nullptr, OPT_BASELINE }, \
+	{ "tolerance", required_argument, nullptr, OPT_TOLERANCE }
+
+struct ResultsOptions {
+	std::string jsonPath, baselinePath;
+	double tolerance = 5;
+
+	// Takes one of the shared options, returns false for anything else
+	bool parse(int opt, const char *arg) {
+		switch(opt) {
+			case OPT_JSON: jsonPath = arg; return true;
+			case OPT_BASELINE: baselinePath = arg; return true;
+			case OPT_TOLERANCE: tolerance = atof(arg); return true;
+		}
+		return false;
+	}
+
+	// Writes the results and checks the baseline; 'rc' is returned unless writing fails (1), the baseline
+	// can't be used (1) or a metric regressed (2). The baseline is only checked for otherwise successful runs.
+	int finish(const JsonValue &results, int rc) const {
+		if(!jsonPath.empty() && !writeResults(jsonPath, results)) { std::cerr << "Can't write results to " << jsonPath << std::endl; if(rc == 0) rc = 1; }
+		if(rc == 0 && !baselinePath.empty()) {
+			int cmp = compareBaseline(results, baselinePath, tolerance, std::cout);
+			if(cmp < 0) rc = 1;
+			if(cmp > 0) rc = 2;
+		}
+		return rc;
+	}
+};
+
+#endif
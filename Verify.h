@@ -0,0 +1,140 @@
+#ifndef UTILVERIFY_H
+#define UTILVERIFY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <immintrin.h>
+
+// Buffer verification shared by the tools. verifyFirstMismatch() picks an
+// AVX-512/AVX2/scalar kernel once at runtime; verifyBuffers() additionally
+// describes every mismatching extent so a failure can be reported compactly.
+
+#define VERIFY_SECTOR 512
+
+namespace verify_detail {
+	inline size_t firstMismatchScalar(const char *got, const char *expected, size_t len) {
+		size_t i = 0;
+		for(; i + 8 <= len; i += 8) {
+			uint64_t a, b;
+			memcpy(&a, got + i, 8);
+			memcpy(&b, expected + i, 8);
+			if(a != b) return i + __builtin_ctzll(a ^ b) / 8;
+		}
+		for(; i < len; i++) if(got[i] != expected[i]) return i;
+		return len;
+	}
+
+	__attribute__((target("avx2")))
+	inline size_t firstMismatchAVX2(const char *got, const char *expected, size_t len) {
+		size_t i = 0;
+		for(; i + 64 <= len; i += 64) {
+			__m256i a0 = _mm256_loadu_si256((const __m256i *)(got + i));
+			__m256i a1 = _mm256_loadu_si256((const __m256i *)(got + i + 32));
+			__m256i b0 = _mm256_loadu_si256((const __m256i *)(expected + i));
+			__m256i b1 = _mm256_loadu_si256((const __m256i *)(expected + i + 32));
+			uint32_t eq0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+			uint32_t eq1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+			if((eq0 & eq1) != 0xffffffffu) {
+				if(eq0 != 0xffffffffu) return i + __builtin_ctz(~eq0);
+				return i + 32 + __builtin_ctz(~eq1);
+			}
+		}
+		return i + firstMismatchScalar(got + i, expected + i, len - i);
+	}
+
+	__attribute__((target("avx512f,avx512bw")))
+	inline size_t firstMismatchAVX512(const char *got, const char *expected, size_t len) {
+		size_t i = 0;
+		for(; i + 64 <= len; i += 64) {
+			__mmask64 ne = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(got + i), _mm512_loadu_si512(expected + i));
+			if(ne) return i + __builtin_ctzll(ne);
+		}
+		return i + firstMismatchScalar(got + i, expected + i, len - i);
+	}
+
+	typedef size_t (*Kernel_t)(const char *, const char *, size_t);
+	inline Kernel_t selectKernel() {
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx512bw")) return firstMismatchAVX512;
+		if(__builtin_cpu_supports("avx2")) return firstMismatchAVX2;
+		return firstMismatchScalar;
+	}
+
+	inline bool allBytes(const char *buf, size_t len, char val) {
+		for(size_t i = 0; i < len; i++) if(buf[i] != val) return false;
+		return true;
+	}
+}
+
+// Returns the offset of the first differing byte, or 'len' if the buffers match
+inline size_t verifyFirstMismatch(const char *got, const char *expected, size_t len) {
+	static const verify_detail::Kernel_t kernel = verify_detail::selectKernel();
+	return kernel(got, expected, len);
+}
+
+struct MismatchExtent {
+	size_t start; // byte offsets [start,end), rounded out to VERIFY_SECTOR
+	size_t end;
+	std::string kind;
+};
+
+class VerifyResult {
+public:
+	size_t firstMismatch;
+	std::vector<MismatchExtent> extents;
+	bool truncated = false;
+	bool ok() const { return extents.empty(); }
+	std::string describe() const {
+		std::ostringstream os;
+		for(auto &iter : extents) os << "  bytes " << iter.start << '-' << (iter.end - 1) << " differ, looks like " << iter.kind << std::endl;
+		if(truncated) os << "  (more mismatching extents not shown)" << std::endl;
+		return os.str();
+	}
+};
+
+// Compares 'got' against 'expected' and groups mismatching sectors into extents.
+// 'stale', if given, is what the region held before it was written and lets
+// unwritten data be told apart from random corruption.
+inline VerifyResult verifyBuffers(const char *got, const char *expected, size_t len, const char *stale = nullptr, size_t maxExtents = 16) {
+	VerifyResult res;
+	res.firstMismatch = verifyFirstMismatch(got, expected, len);
+	size_t pos = res.firstMismatch;
+	while(pos < len) {
+		if(res.extents.size() == maxExtents) { res.truncated = true; break; }
+		MismatchExtent ext;
+		ext.start = pos - pos % VERIFY_SECTOR;
+		ext.end = ext.start;
+		// extend the extent while consecutive sectors keep mismatching
+		while(ext.end < len) {
+			size_t sectorLen = std::min((size_t)VERIFY_SECTOR, len - ext.end);
+			if(verifyFirstMismatch(got + ext.end, expected + ext.end, sectorLen) == sectorLen) break;
+			ext.end += sectorLen;
+		}
+		size_t extLen = ext.end - ext.start;
+		const char *region = got + ext.start;
+		if(verify_detail::allBytes(region, extLen, 0)) ext.kind = "zeroed data";
+		else if(verify_detail::allBytes(region, extLen, region[0])) ext.kind = "a constant fill";
+		else if(stale != nullptr && verifyFirstMismatch(region, stale + ext.start, extLen) == extLen) ext.kind = "stale data (write lost)";
+		else {
+			ext.kind = "corrupted data";
+			for(size_t src = 0; src + extLen <= len; src += VERIFY_SECTOR) {
+				if(src == ext.start || verifyFirstMismatch(region, expected + src, extLen) != extLen) continue;
+				std::ostringstream os;
+				os << "shifted data (matches expected bytes " << src << '-' << (src + extLen - 1) << ')';
+				ext.kind = os.str();
+				break;
+			}
+		}
+		res.extents.push_back(ext);
+		if(ext.end >= len) break;
+		pos = ext.end + verifyFirstMismatch(got + ext.end, expected + ext.end, len - ext.end);
+	}
+	return res;
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef UTILWORKERPOOL_H
+#define UTILWORKERPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Threads that live across test phases. Worker i keeps its thread (and so its
+// CPU, its caches and anything it allocated) from one phase to the next, and
+// with setCpus() it is pinned to cpus[i % cpus.size()]. Memory a worker
+// allocates and touches first lands on its own NUMA node under Linux's default
+// first-touch policy, so buffers a worker takes from BufferArena::local() are
+// NUMA local.
+class WorkerPool {
+public:
+	WorkerPool() { }
+	~WorkerPool() {
+		{ std::lock_guard<std::mutex> lock(mtx); quit = true; }
+		startCv.notify_all();
+		for(auto &iter : threads) iter.join();
+	}
+	WorkerPool(const WorkerPool &) = delete;
+	WorkerPool &operator=(const WorkerPool &) = delete;
+
+	// Pins worker i to cpus[i % cpus.size()], an empty list unpins
+	bool setCpus(const std::vector<int> &newCpus) {
+		cpus = newCpus;
+		bool ok = true;
+		for(unsigned i = 0; i < threads.size(); i++) ok = pin(i) && ok;
+		return ok;
+	}
+	const std::vector<int> &getCpus() const { return cpus; }
+
+	// Runs job(i) for i in [0,n) on workers 0..n-1 and returns at once; wait() collects the results
+	void start(unsigned n, std::function<int64_t(unsigned)> newJob) {
+		while(threads.size() < n) {
+			unsigned idx = threads.size();
+			threads.emplace_back([this, idx]() { loop(idx); });
+			if(!cpus.empty()) pin(idx);
+		}
+		std::lock_guard<std::mutex> lock(mtx);
+		job = std::move(newJob);
+		results.assign(n, 0);
+		active = n;
+		remaining = n;
+		generation++;
+		startCv.notify_all();
+	}
+	std::vector<int64_t> wait() {
+		std::unique_lock<std::mutex> lock(mtx);
+		doneCv.wait(lock, [this]() { return remaining == 0; });
+		return results;
+	}
+
+	// Parses "0-3,8,10-11"
+	static bool parseCpuList(const char *list, std::vector<int> &out) {
+		std::vector<int> res;
+		const char *pos = list;
+		while(*pos) {
+			char *end;
+			long first = strtol(pos, &end, 10);
+			if(end == pos || first < 0) return false;
+			long last = first;
+			if(*end == '-') {
+				pos = end + 1;
+				last = strtol(pos, &end, 10);
+				if(end == pos || last < first) return false;
+			}
+			for(long cpu = first; cpu <= last; cpu++) res.push_back((int) cpu);
+			if(*end == ',') end++;
+			else if(*end) return false;
+			pos = end;
+		}
+		if(res.empty()) return false;
+		out = res;
+		return true;
+	}
+
+private:
+	void loop(unsigned idx) {
+		uint64_t seen = 0;
+		while(true) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				startCv.wait(lock, [&]() { return quit || (generation != seen && idx < active); });
+				if(quit) return;
+				seen = generation;
+			}
+			int64_t res = job(idx); // 'job' stays put until every worker of this generation is done
+			std::lock_guard<std::mutex> lock(mtx);
+			results[idx] = res;
+			if(--remaining == 0) doneCv.notify_all();
+		}
+	}
+
+	bool pin(unsigned idx) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(cpus.empty()) for(unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &set);
+		else CPU_SET(cpus[idx % cpus.size()], &set);
+		return pthread_setaffinity_np(threads[idx].native_handle(), sizeof(set), &set) == 0;
+	}
+
+	std::vector<std::thread> threads;
+	std::vector<int> cpus;
+	std::mutex mtx;
+	std::condition_variable startCv, doneCv;
+	std::function<int64_t(unsigned)> job;
+	std::vector<int64_t> results;
+	unsigned active = 0, remaining = 0;
+	uint64_t generation = 0;
+	bool quit = false;
+};
+
+#endif
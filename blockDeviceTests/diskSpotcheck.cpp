@@ -25,78 +25,641 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <glob.h>
 #include <iostream>
+#include <sstream>
 #include <inttypes.h>
 #include <errno.h>
 #include <string.h>
 #include <chrono>
 #include <memory>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+#include "../BoundedQueue.h"
+#include "../File.h"
+#include "../Pattern.h"
+#include "../Verify.h"
+#include "../Results.h"
+#include "../Crc32c.h"
+#include "../BlockStamp.h"
+#include "diskSpotcheck_manifest.h"
+#include <getopt.h>
 
 using namespace std;
 
-#include <fstream>
-static void dropSystemCache() {
-	// Clear cache for benchmarking
-	sync();
-	std::ofstream ofs("/proc/sys/vm/drop_caches");
-	ofs << "3" << std::endl;
-	ofs.close();
+// Line buffered stream that writes whole lines to 'dest', each with 'prefix' in front, under one
+// lock shared by all of them, so that devices checked at the same time never interleave mid-line
+class PrefixedStream : public std::ostream {
+public:
+	PrefixedStream(const std::string &prefix, std::ostream &dest) : std::ostream(nullptr), buf(prefix, dest) { rdbuf(&buf); }
+	~PrefixedStream() { buf.pubsync(); }
+private:
+	class LineBuf : public std::stringbuf {
+	public:
+		LineBuf(const std::string &prefix, std::ostream &dest) : std::stringbuf(std::ios_base::out | std::ios_base::ate), prefix(prefix), dest(dest) { }
+	protected:
+		int sync() override {
+			std::string text = str();
+			size_t end = text.rfind('\n');
+			if(end == std::string::npos) return 0;
+			std::string lines;
+			for(size_t pos = 0; pos <= end; ) {
+				size_t eol = text.find('\n', pos);
+				lines += prefix + text.substr(pos, eol + 1 - pos);
+				pos = eol + 1;
+			}
+			{
+				static std::mutex mtx;
+				std::lock_guard<std::mutex> lock(mtx);
+				dest << lines << std::flush;
+			}
+			str(text.substr(end + 1));
+			return 0;
+		}
+	private:
+		std::string prefix;
+		std::ostream &dest;
+	};
+	LineBuf buf;
+};
+
+// One device under test and what its run produced. With several devices each runs its passes in
+// its own thread, and every line it prints starts with its name.
+struct TestDevice {
+	TestDevice(const std::string &path, uint64_t size, const std::string &prefix) : path(path), size(size), prefix(prefix), out(prefix, cout), err(prefix, cerr) { }
+	std::string path;
+	uint64_t size;
+	std::string prefix;
+	PrefixedStream out, err;
+	bool failed = false;
+	std::vector<double> speeds;     // of each pass
+	uint64_t bytes = 0;             // tested by the passes that completed
+	double duration = 0;
+	JsonValue phases = JsonValue::array();
+	JsonValue errors = JsonValue::array();
+};
+
+// Verifier threads shared by every device of a run, so that checking scales with the CPUs rather
+// than with the number of devices. Readers hand over a buffer along with the batch whose check takes it;
+// a batch counts the buffers still queued or being checked, and its owner waits for that to reach zero
+// before the check (and whatever it refers to) goes out of scope.
+class VerifyPool {
+public:
+	typedef std::function<void(uint64_t, char *)> Check;
+	class Batch {
+	public:
+		explicit Batch(const Check &check) : check(check) { }
+		~Batch() { wait(); }
+		void wait() {
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this]() { return outstanding == 0; });
+		}
+	private:
+		friend class VerifyPool;
+		void run(uint64_t idx, char *buf) {
+			check(idx, buf);
+			// notify under the lock: the owner may destroy the batch as soon as it sees zero
+			std::lock_guard<std::mutex> lock(mutex);
+			if(--outstanding == 0) idle.notify_all();
+		}
+		const Check &check;
+		std::mutex mutex;
+		std::condition_variable idle;
+		size_t outstanding = 0;
+	};
+	explicit VerifyPool(unsigned numThreads) : queue(4 * (size_t)numThreads) {
+		for(unsigned t = 0; t < numThreads; t++) threads.emplace_back([this]() {
+			Task cur;
+			while((cur = queue.pop()).batch != nullptr) cur.batch->run(cur.idx, cur.buf);
+		});
+	}
+	~VerifyPool() {
+		for(size_t t = 0; t < threads.size(); t++) queue.push({nullptr, 0, nullptr});
+		for(auto &iter : threads) iter.join();
+	}
+	void push(Batch &batch, uint64_t idx, char *buf) {
+		{
+			std::lock_guard<std::mutex> lock(batch.mutex);
+			batch.outstanding++;
+		}
+		queue.push({&batch, idx, buf});
+	}
+private:
+	struct Task { Batch *batch; uint64_t idx; char *buf; };
+	BoundedQueue<Task> queue;
+	std::vector<std::thread> threads;
+};
+
+// Makes the reads that follow come from the device. Only the device's own pages are
+// dropped, so this needs no root and leaves the rest of the host's cache alone.
+static void dropDeviceCache(File &file, std::ostream &err) {
+	if(file.dropCache(0, 0) != 0 && errno != ENOTSUP) err << "Warning: can't drop cached pages of the device: " << strerror(errno) << endl;
+}
+
+// What a block of a pass holds: the plain pattern, or with 'stamped' (--stamp) the same pattern
+// with a self-describing header in every 4KB, written as write number 'seq' of the pass
+static inline void fillBlock(char *buf, size_t len, uint64_t seed, char c, uint64_t offset, uint64_t seq, bool stamped) {
+	if(stamped) StampedPattern(seed,c).fill(buf,len,offset,(uint32_t)seq);
+	else PatternGen(seed,c,offset).fill(buf,len);
+}
+// Offset of the first bad byte (first bad block when stamped), 'len' if the block is right.
+// Stamped blocks are checked by their CRCs, plain ones against the regenerated pattern.
+static inline size_t checkBlock(const char *buf, size_t len, uint64_t seed, char c, uint64_t offset, bool stamped) {
+	if(stamped) return StampedPattern(seed,c).check(buf,len,offset,0).firstBad;
+	return PatternGen(seed,c,offset).mismatch(buf,len);
+}
+// Says what a bad block holds instead. Stamps tell it directly; plain data is compared with what
+// this pass wrote there and with 'stale', what the device held before (nullptr if unknown).
+static std::string describeBad(const char *got, size_t len, uint64_t seed, char c, uint64_t offset, bool stamped, const char *stale) {
+	if(stamped) return StampedPattern(seed,c).check(got,len,offset).describe();
+	std::unique_ptr<char[]> expected = std::make_unique<char[]>(len);
+	PatternGen(seed,c,offset).fill(expected.get(),len);
+	return verifyBuffers(got,expected.get(),len,stale).describe();
+}
+
+// Keeps the lowest-indexed failure of a pass so that a parallel pass reports exactly what the serial one would
+class PassFailure {
+public:
+	bool isBefore(uint64_t i) { return i < first.load(std::memory_order_relaxed); }
+	bool failed() { return first.load() != UINT64_MAX; }
+	void set(uint64_t i, int inCode, size_t inOffset, const char *inGot, size_t len) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if(i >= first.load()) return;
+		first.store(i);
+		code = inCode;
+		err = errno;
+		offset = inOffset;
+		if(inGot != nullptr) { got = std::make_unique<char[]>(len); memcpy(got.get(), inGot, len); }
+	}
+	std::atomic<uint64_t> first{UINT64_MAX};
+	int code = 0;
+	int err = 0;
+	size_t offset = 0;
+	std::unique_ptr<char[]> got;
+private:
+	std::mutex mtx;
+};
+
+// Writes each location's pattern, 'numThreads' writers pulling the next location from a shared counter.
+// With a 'manifest', each writer also records the checksum of what it wrote.
+static void writeLocs(File &file, uint64_t seed, char c, size_t bufSize, const std::vector<uint64_t> &locs, uint8_t numThreads, PassFailure &failure, Manifest *manifest, bool stamped) {
+	std::atomic<uint64_t> next{0};
+	std::vector<std::thread> writers;
+	for(uint8_t t = 0; t < numThreads; t++) writers.emplace_back([&]() {
+		BufferArena::Slab bufSlab = BufferArena::local().slab(bufSize);
+		char *buf = bufSlab.data();
+		if(buf == nullptr) { failure.set(0,-1,0,nullptr,0); return; }
+		uint64_t i;
+		while((i = next++) < locs.size() && failure.isBefore(i)) {
+			fillBlock(buf,bufSize,seed,c,locs[i],i,stamped);
+			if(manifest) manifest->set(i,locs[i],bufSize,Crc32c::compute(buf,bufSize));
+			if(file.write(buf,bufSize,locs[i]) != (ssize_t)bufSize) failure.set(i,-1,0,nullptr,0);
+		}
+	});
+	for(auto &iter : writers) iter.join();
+}
+
+// Reads back every location: reader threads fill buffers from a free list and hand them to the verifier pool.
+// Returns once the pool has checked everything that was read.
+static void verifyLocs(File &file, VerifyPool &pool, uint64_t seed, char c, size_t bufSize, const std::vector<uint64_t> &locs, uint8_t numThreads, PassFailure &failure, bool stamped) {
+	const size_t numBufs = 4 * (size_t)numThreads;
+	BufferArena::Slab bufs = BufferArena::local().slab(bufSize, numBufs);
+	if(!bufs) { failure.set(0,-3,0,nullptr,0); return; }
+	BoundedQueue<char *> freeBufs(numBufs);
+	for(size_t i = 0; i < numBufs; i++) freeBufs.push(bufs.at(i));
+	VerifyPool::Check check = [&](uint64_t idx, char *buf) {
+		if(failure.isBefore(idx)) {
+			size_t j = checkBlock(buf,bufSize,seed,c,locs[idx],stamped);
+			if(j != bufSize) failure.set(idx,-4,j,buf,bufSize);
+		}
+		freeBufs.push(buf);
+	};
+	VerifyPool::Batch batch(check);
+
+	std::atomic<uint64_t> next{0};
+	std::vector<std::thread> readers;
+	for(uint8_t t = 0; t < numThreads; t++) readers.emplace_back([&]() {
+		uint64_t i;
+		while((i = next++) < locs.size() && failure.isBefore(i)) {
+			char *buf = freeBufs.pop();
+			if(file.read(buf,bufSize,locs[i]) != (ssize_t)bufSize) { failure.set(i,-3,0,nullptr,0); freeBufs.push(buf); }
+			else pool.push(batch, i, buf);
+		}
+	});
+	for(auto &iter : readers) iter.join();
+	batch.wait();
+}
+
+// Prints how far a sweep stage has got every few seconds while it runs
+class SweepProgress {
+public:
+	SweepProgress(const char *what, uint64_t total, const std::string &prefix) : what(what), total(total), out(prefix, cout), startT(std::chrono::steady_clock::now()) {
+		reporter = std::thread([this]() {
+			std::unique_lock<std::mutex> lock(mtx);
+			while(!stopCv.wait_for(lock, std::chrono::seconds(5), [this]() { return stopping; })) report();
+		});
+	}
+	~SweepProgress() {
+		{ std::lock_guard<std::mutex> lock(mtx); stopping = true; }
+		stopCv.notify_all();
+		reporter.join();
+	}
+	void add(uint64_t bytes) { done.fetch_add(bytes, std::memory_order_relaxed); }
+	double speed() const { return (done.load() / seconds()) / (1024*1024); }
+	double seconds() const { return std::max(std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0, 0.001); }
+private:
+	void report() {
+		uint64_t cur = done.load();
+		out << "  " << what << ' ' << cur / (1024*1024) << '/' << total / (1024*1024) << "MB (" << (int)(100.0 * cur / total) << "%) at " << speed() << " MB/s" << endl;
+	}
+	const char *what;
+	uint64_t total;
+	PrefixedStream out;
+	std::chrono::steady_clock::time_point startT;
+	std::atomic<uint64_t> done{0};
+	std::mutex mtx;
+	std::condition_variable stopCv;
+	bool stopping = false;
+	std::thread reporter;
+};
+
+// Sweep blocks are numbered from the start of the device; the last one may be short
+static inline size_t sweepLen(uint64_t idx, size_t blockSize, uint64_t devSize) { return std::min<uint64_t>(blockSize, devSize - idx * blockSize); }
+
+// Writes every block in device order. Generator threads fill free buffers while 'ioDepth'
+// writer threads keep that many writes in flight, with three buffers per writer so that
+// generation never waits on the device and the device never waits on generation.
+static void sweepWrite(File &file, uint64_t seed, char c, size_t blockSize, uint64_t devSize, uint8_t numThreads, unsigned ioDepth, PassFailure &failure, SweepProgress &progress, Manifest *manifest, bool stamped) {
+	struct Pending { uint64_t idx; char *buf; };
+	const uint64_t numBlocks = (devSize + blockSize - 1) / blockSize;
+	const size_t numBufs = 3 * (size_t)ioDepth + numThreads;
+	BufferArena::Slab bufs = BufferArena::local().slab(blockSize, numBufs);
+	if(!bufs) { failure.set(0,-1,0,nullptr,0); return; }
+	BoundedQueue<char *> freeBufs(numBufs);
+	BoundedQueue<Pending> fullBufs(numBufs + ioDepth);
+	for(size_t i = 0; i < numBufs; i++) freeBufs.push(bufs.at(i));
+
+	std::atomic<uint64_t> next{0};
+	std::vector<std::thread> generators, writers;
+	for(uint8_t t = 0; t < numThreads; t++) generators.emplace_back([&]() {
+		uint64_t i;
+		while((i = next++) < numBlocks && failure.isBefore(i)) {
+			char *buf = freeBufs.pop();
+			size_t len = sweepLen(i,blockSize,devSize);
+			fillBlock(buf,len,seed,c,i * blockSize,i,stamped);
+			if(manifest) manifest->set(i,i * blockSize,len,Crc32c::compute(buf,len));
+			fullBufs.push({i, buf});
+		}
+	});
+	for(unsigned t = 0; t < ioDepth; t++) writers.emplace_back([&]() {
+		Pending cur;
+		while((cur = fullBufs.pop()).buf != nullptr) {
+			size_t len = sweepLen(cur.idx,blockSize,devSize);
+			if(failure.isBefore(cur.idx)) {
+				if(file.write(cur.buf,len,cur.idx * blockSize) != (ssize_t)len) failure.set(cur.idx,-1,0,nullptr,0);
+				else progress.add(len);
+			}
+			freeBufs.push(cur.buf);
+		}
+	});
+	for(auto &iter : generators) iter.join();
+	for(unsigned t = 0; t < ioDepth; t++) fullBufs.push({0, nullptr});
+	for(auto &iter : writers) iter.join();
+}
+
+// Reads every block back in device order with 'ioDepth' readers in flight; the verifier pool
+// checks each one as it arrives (see checkBlock()), so no expected copy is ever built
+static void sweepVerify(File &file, VerifyPool &pool, uint64_t seed, char c, size_t blockSize, uint64_t devSize, uint8_t numThreads, unsigned ioDepth, PassFailure &failure, SweepProgress &progress, bool stamped) {
+	const uint64_t numBlocks = (devSize + blockSize - 1) / blockSize;
+	const size_t numBufs = 3 * (size_t)ioDepth + numThreads;
+	BufferArena::Slab bufs = BufferArena::local().slab(blockSize, numBufs);
+	if(!bufs) { failure.set(0,-3,0,nullptr,0); return; }
+	BoundedQueue<char *> freeBufs(numBufs);
+	for(size_t i = 0; i < numBufs; i++) freeBufs.push(bufs.at(i));
+	VerifyPool::Check check = [&](uint64_t idx, char *buf) {
+		size_t len = sweepLen(idx,blockSize,devSize);
+		if(failure.isBefore(idx)) {
+			size_t j = checkBlock(buf,len,seed,c,idx * blockSize,stamped);
+			if(j != len) failure.set(idx,-4,j,buf,len);
+			progress.add(len);
+		}
+		freeBufs.push(buf);
+	};
+	VerifyPool::Batch batch(check);
+
+	std::atomic<uint64_t> next{0};
+	std::vector<std::thread> readers;
+	for(unsigned t = 0; t < ioDepth; t++) readers.emplace_back([&]() {
+		uint64_t i;
+		while((i = next++) < numBlocks && failure.isBefore(i)) {
+			char *buf = freeBufs.pop();
+			size_t len = sweepLen(i,blockSize,devSize);
+			if(file.read(buf,len,i * blockSize) != (ssize_t)len) { failure.set(i,-3,0,nullptr,0); freeBufs.push(buf); }
+			else pool.push(batch, i, buf);
+		}
+	});
+	for(auto &iter : readers) iter.join();
+	batch.wait();
+}
+
+// One pass over the whole device: write every block, then read back and verify every block.
+// Returns the speed of the pass like doPass(), and each stage's own speed in 'writeSpeed'/'verifySpeed'.
+double doSweep(TestDevice &dev, VerifyPool &pool, uint64_t seed, char c, size_t blockSize, bool readOnly, uint8_t numThreads, unsigned ioDepth, double &writeSpeed, double &verifySpeed, Manifest *manifest, bool stamped) {
+	const uint64_t devSize = dev.size;
+	std::unique_ptr<File> file = openFile<FileDirect>(dev.path.c_str());
+	if(file->getSize() == 0) {
+		file = openFile<FileUnbuffered>(dev.path.c_str());
+		if(file->getSize() == 0) return -1;
+		dev.out << "Note: can't open " << dev.path << " for direct I/O, sweeping through the page cache" << endl;
+	}
+	dropDeviceCache(*file,dev.err);
+	dev.out << "Starting sweep of char=" << c << " over " << devSize / (1024*1024.0) << "MB" << endl;
+	auto startT = std::chrono::steady_clock::now();
+	PassFailure failure;
+	writeSpeed = verifySpeed = 0;
+	if(!readOnly) {
+		SweepProgress progress("written", devSize, dev.prefix);
+		if(manifest) manifest->begin(seed,c,devSize,blockSize,true,(devSize + blockSize - 1) / blockSize,stamped);
+		sweepWrite(*file,seed,c,blockSize,devSize,numThreads,ioDepth,failure,progress,manifest,stamped);
+		if(failure.failed()) { dev.err << "Didn't complete a write of block " << failure.first << " at " << failure.first * blockSize << " because " << strerror(failure.err) << endl; return -1; }
+		if(file->flush() == -1) { dev.err << "Sync error: " << strerror(errno) << endl; return -3; }
+		writeSpeed = progress.speed();
+		dev.out << "Wrote " << devSize / (1024*1024.0) << "MB in " << progress.seconds() << " seconds at " << writeSpeed << " MB/s" << endl;
+		dropDeviceCache(*file,dev.err);
+	}
+	{
+		SweepProgress progress("verified", devSize, dev.prefix);
+		sweepVerify(*file,pool,seed,c,blockSize,devSize,numThreads,ioDepth,failure,progress,stamped);
+		verifySpeed = progress.speed();
+		if(!failure.failed()) dev.out << "Verified " << devSize / (1024*1024.0) << "MB in " << progress.seconds() << " seconds at " << verifySpeed << " MB/s" << endl;
+	}
+	file.reset();
+	uint64_t badOffset = failure.first * blockSize;
+	if(failure.code == -3) { dev.err << "Didn't complete a read of block " << failure.first << " at " << badOffset << " because " << strerror(failure.err) << endl; return -3; }
+	if(failure.code == -4) {
+		size_t len = sweepLen(failure.first,blockSize,devSize);
+		// every pass of a sweep writes the same blocks, so the block held the previous pass's data
+		std::unique_ptr<char[]> stale;
+		if(c > 'a') { stale = std::make_unique<char[]>(len); PatternGen(seed,c-1,badOffset).fill(stale.get(),len); }
+		dev.err << "Verification of write/read failed in block " << failure.first << " at " << badOffset << ", offset=" << failure.offset << endl;
+		dev.err << describeBad(failure.got.get(),len,seed,c,badOffset,stamped,stale.get());
+		return -4;
+	}
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
+	double speed = ((double)devSize/duration)/(1024*1024);
+	dev.bytes += devSize;
+	dev.out << "Sweep completed in " << duration << " seconds. Speed= " << speed << " MB/s." << endl;
+	return speed;
 }
 
-double doPass(std::string &diskPath, char c, uint64_t maxLoc, size_t bufSize, bool readOnly, uint32_t locCnt) {
-	std::unique_ptr<char[]> raiiBuf = std::make_unique<char[]>(bufSize);
-	char *buf = raiiBuf.get();
+// The locations pass 'c' of a spot check writes over 'devSize' bytes, in increasing order and never overlapping
+static std::vector<uint64_t> passLocs(uint64_t seed, char c, uint64_t devSize, size_t bufSize, uint32_t locCnt) {
 	std::vector<uint64_t> locs(locCnt);
+	PatternGen locGen(seed,c,UINT64_MAX);
 
-	dropSystemCache();
-	srand(c);
-	for(uint64_t i = 0; i < bufSize; i++) buf[i] = rand();
-	maxLoc -= bufSize; // make sure we don't accidentally try to write off the end of the file
+	uint64_t maxLoc = devSize - bufSize; // make sure we don't accidentally try to write off the end of the file
 	locs[0] = 0; // make sure we get the beginning
 	locs[locCnt - 1] = maxLoc; // make sure we get the end
 	for(uint64_t i = 1; i < locCnt - 1; i++) {
-		locs[i] = (((float)rand() / RAND_MAX) * (maxLoc - locs[i-1] - bufSize)) / ((locCnt - 2)/4) + locs[i-1] + bufSize; // set up the location to be written relative to the last one
+		locs[i] = (locGen.fraction(i) * (maxLoc - locs[i-1] - bufSize)) / ((locCnt - 2)/4) + locs[i-1] + bufSize; // set up the location to be written relative to the last one
 	}
-	cout << "Starting test of char=" << c << endl;
+	return locs;
+}
+
+// What 'len' bytes at 'offset' held before pass 'c' wrote them, had that write been lost: each
+// earlier pass draws its own locations, so every byte comes from the last earlier pass whose
+// blocks covered it. Bytes no earlier pass wrote are unknown and are left as what 'c' wrote,
+// which never matches as stale.
+static std::unique_ptr<char[]> staleSpot(uint64_t seed, char c, uint64_t offset, size_t len, uint64_t devSize, size_t bufSize, uint32_t locCnt) {
+	std::unique_ptr<char[]> stale = std::make_unique<char[]>(len);
+	PatternGen(seed,c,offset).fill(stale.get(),len);
+	for(char prev = 'a'; prev < c; prev++) {
+		std::vector<uint64_t> locs = passLocs(seed,prev,devSize,bufSize,locCnt);
+		auto iter = std::upper_bound(locs.begin(), locs.end(), offset + len - 1);
+		while(iter != locs.begin()) {
+			uint64_t loc = *--iter;
+			if(loc + bufSize <= offset) break;
+			uint64_t start = std::max(loc, offset), end = std::min<uint64_t>(loc + bufSize, offset + len);
+			PatternGen(seed,prev,loc).fill(stale.get() + (start - offset), end - start, start - loc);
+		}
+	}
+	return stale;
+}
+
+double doPass(TestDevice &dev, VerifyPool &pool, uint64_t seed, char c, size_t bufSize, bool readOnly, uint32_t locCnt, uint8_t numThreads, Manifest *manifest, bool stamped) {
+	std::vector<uint64_t> locs = passLocs(seed,c,dev.size,bufSize,locCnt);
+	std::unique_ptr<File> file = openFile<FileUnbuffered>(dev.path.c_str());
+	if(file->getSize() == 0) return -1;
+	dropDeviceCache(*file,dev.err);
+	dev.out << "Starting test of char=" << c << endl;
 	auto startT = std::chrono::steady_clock::now();
-	int fd;
-	if((fd = open(diskPath.c_str(),O_RDWR|O_LARGEFILE)) == -1) return -1;
+	PassFailure failure;
 	if(!readOnly) {
-		for(uint64_t i = 0; i < locCnt; i++) {
-			//		cout << i << ": Writing to " << locs[i] << endl;
-			lseek64(fd,locs[i],SEEK_SET);
-			if(write(fd,buf,bufSize) != (int)bufSize) { cerr << "Didn't complete a write of " << bufSize << " * '" << c << "' at " << locs[i] << " because " << strerror(errno) << endl; return -1; }
-		}
-		if(syncfs(fd) == -1) { cerr << "Sync error: " << strerror(errno) << endl; return -3; }
-		dropSystemCache();
-	}
-	for(uint64_t i = 0; i < locCnt; i++) {
-		//		cout << i << ": Reading from " << locs[i] << endl;
-		lseek64(fd,locs[i],SEEK_SET);
-		if(read(fd,buf,bufSize) != (int)bufSize) { cerr << "Didn't complete a read of " << bufSize << " * '" << c << "' at " << locs[i] << " because " << strerror(errno) << endl; return -3; }
-		srand(c);
-		char rng;
-		for(uint64_t j = 0; j < bufSize; j++)
-			if(buf[j] != (rng = rand())) {
-				cerr << "Verification of write/read failed at location " << locs[i] << ", offset=" << j << endl;
-				cerr << "  expected=";
-				for(uint64_t k = 0; k < bufSize; k++) { cerr << (int)rng << ','; rng = rand(); }
-				cerr << endl;
-				cerr << "       got=";
-				for(uint64_t k = 0; k < bufSize; k++) cerr << (int)buf[k] << ',';
-				cerr << endl;
-				return -4;
-			}
+		if(manifest) manifest->begin(seed,c,dev.size,bufSize,false,locCnt,stamped);
+		writeLocs(*file,seed,c,bufSize,locs,numThreads,failure,manifest,stamped);
+		if(failure.failed()) { dev.err << "Didn't complete a write of " << bufSize << " * '" << c << "' at " << locs[failure.first] << " because " << strerror(failure.err) << endl; return -1; }
+		if(file->flush() == -1) { dev.err << "Sync error: " << strerror(errno) << endl; return -3; }
+		dropDeviceCache(*file,dev.err);
+	}
+	verifyLocs(*file,pool,seed,c,bufSize,locs,numThreads,failure,stamped);
+	file.reset();
+	if(failure.code == -3) { dev.err << "Didn't complete a read of " << bufSize << " * '" << c << "' at " << locs[failure.first] << " because " << strerror(failure.err) << endl; return -3; }
+	if(failure.code == -4) {
+		std::unique_ptr<char[]> stale = staleSpot(seed,c,locs[failure.first],bufSize,dev.size,bufSize,locCnt);
+		dev.err << "Verification of write/read failed at location " << locs[failure.first] << ", offset=" << failure.offset << endl;
+		dev.err << describeBad(failure.got.get(),bufSize,seed,c,locs[failure.first],stamped,stale.get());
+		return -4;
 	}
-	close(fd);
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
 	double speed = ((double)(bufSize*locCnt)/duration)/(1024*1024);
-	cout << "Test completed in " << duration << " seconds. Speed= " << speed << " MB/s." << endl;
+	dev.bytes += (uint64_t)bufSize * locCnt;
+	dev.out << "Test completed in " << duration << " seconds. Speed= " << speed << " MB/s." << endl;
 	return speed;
 }
 
-#define doUsage(errStream) { cerr << errStream << endl << "Usage: " << argv[0] << " [-d <device=/dev/nbd0>] [-s <diskSizeInMB=auto>] [-b <bufSizeInKB=64>] [-l <locCount=1000>] [-p <numPasses=3>] [-h] [-r]" << endl; return -1; }
+// Verifies a device against a manifest instead of regenerating the data, so all it needs is the
+// manifest and it runs at device bandwidth. 'selected' lists the entries to check (empty = all).
+// Unlike a pass it goes on past a bad block: a retention check wants to know about all of them.
+// Entries that don't fit in a block or on the device are reported as bad entries and not read.
+struct EntryRange { uint64_t first, last; };
+struct ManifestCheck {
+	uint64_t checked = 0;
+	uint64_t bytes = 0;
+	uint64_t readErrors = 0;
+	uint64_t mismatches = 0;
+	uint64_t badEntries = 0;
+	double speed = 0;
+};
+static bool verifyManifest(const std::string &diskPath, const ManifestReader &manifest, const std::vector<EntryRange> &selected, uint8_t numThreads, unsigned ioDepth, ManifestCheck &check) {
+	struct Pending { uint64_t idx; char *buf; };
+	struct Bad { uint64_t idx; std::string what; };
+	const ManifestHeader &hdr = manifest.header();
+	// spot check locations are not sector aligned, so only a sweep can be read back direct
+	std::unique_ptr<File> file = hdr.sweep ? openFile<FileDirect>(diskPath.c_str()) : openFile<FileUnbuffered>(diskPath.c_str());
+	if(file->getSize() == 0) file = openFile<FileUnbuffered>(diskPath.c_str());
+	if(file->getSize() == 0) { cerr << "Can't open " << diskPath << ": " << strerror(errno) << endl; return false; }
+	if(file->getSize() < hdr.deviceSize) cerr << "Warning: " << diskPath << " is smaller than the " << hdr.deviceSize << " bytes the manifest was written over" << endl;
+	dropDeviceCache(*file,cerr);
+
+	// the k-th selected entry is found through where each range starts in the selection
+	std::vector<uint64_t> rangeStart;
+	uint64_t count = selected.empty() ? hdr.numEntries : 0;
+	for(auto &iter : selected) { rangeStart.push_back(count); count += iter.last - iter.first + 1; }
+	auto entryIdx = [&](uint64_t k) {
+		if(selected.empty()) return k;
+		size_t r = std::upper_bound(rangeStart.begin(), rangeStart.end(), k) - rangeStart.begin() - 1;
+		return selected[r].first + (k - rangeStart[r]);
+	};
+	const uint64_t diskSize = file->getSize();
+	auto validEntry = [&](const ManifestEntry &ent) { return ent.length <= hdr.blockSize && ent.offset <= diskSize && ent.length <= diskSize - ent.offset; };
+	uint64_t totalBytes = 0;
+	for(uint64_t k = 0; k < count; k++) {
+		const ManifestEntry &ent = manifest.entry(entryIdx(k));
+		if(validEntry(ent)) totalBytes += ent.length;
+	}
+	const size_t numBufs = 3 * (size_t)ioDepth + numThreads;
+	BufferArena::Slab bufs = BufferArena::local().slab(hdr.blockSize, numBufs);
+	if(!bufs) { cerr << "Failed allocating buffers" << endl; return false; }
+	BoundedQueue<char *> freeBufs(numBufs);
+	BoundedQueue<Pending> readBufs(numBufs + numThreads);
+	for(size_t i = 0; i < numBufs; i++) freeBufs.push(bufs.at(i));
+
+	std::mutex badMtx;
+	std::vector<Bad> bad;
+	std::atomic<uint64_t> readErrors{0}, mismatches{0}, badEntries{0};
+	auto addBad = [&](uint64_t idx, const std::string &what) { std::lock_guard<std::mutex> lock(badMtx); bad.push_back({idx, what}); };
+	std::atomic<uint64_t> next{0};
+	std::vector<std::thread> readers, verifiers;
+	{
+		SweepProgress progress("verified", totalBytes, "");
+		for(unsigned t = 0; t < ioDepth; t++) readers.emplace_back([&]() {
+			uint64_t k;
+			while((k = next++) < count) {
+				uint64_t idx = entryIdx(k);
+				const ManifestEntry &ent = manifest.entry(idx);
+				if(!validEntry(ent)) {
+					badEntries++;
+					addBad(idx, "bad manifest entry: past the block size of " + std::to_string(hdr.blockSize) + " or the end of the device at " + std::to_string(diskSize));
+					continue;
+				}
+				char *buf = freeBufs.pop();
+				if(file->read(buf,ent.length,ent.offset) != (ssize_t)ent.length) {
+					readErrors++;
+					addBad(idx, std::string("read failed: ") + strerror(errno));
+					freeBufs.push(buf);
+				} else readBufs.push({idx, buf});
+			}
+		});
+		for(uint8_t t = 0; t < numThreads; t++) verifiers.emplace_back([&]() {
+			Pending cur;
+			while((cur = readBufs.pop()).buf != nullptr) {
+				const ManifestEntry &ent = manifest.entry(cur.idx);
+				if(Crc32c::compute(cur.buf,ent.length) != ent.crc) {
+					// the pattern is still known, so say what the bad data looks like for the first few
+					std::string what = "checksum mismatch";
+					if(mismatches++ < 8) {
+						what += "\n" + describeBad(cur.buf,ent.length,hdr.seed,hdr.pass,ent.offset,hdr.stamped,nullptr);
+						if(what.back() == '\n') what.pop_back();
+					}
+					addBad(cur.idx, what);
+				}
+				progress.add(ent.length);
+				freeBufs.push(cur.buf);
+			}
+		});
+		for(auto &iter : readers) iter.join();
+		for(uint8_t t = 0; t < numThreads; t++) readBufs.push({0, nullptr});
+		for(auto &iter : verifiers) iter.join();
+		check.speed = progress.speed();
+	}
+	check.checked = count;
+	check.bytes = totalBytes;
+	check.readErrors = readErrors;
+	check.mismatches = mismatches;
+	check.badEntries = badEntries;
+	std::sort(bad.begin(), bad.end(), [](const Bad &a, const Bad &b) { return a.idx < b.idx; });
+	for(size_t i = 0; i < bad.size() && i < 20; i++) {
+		const ManifestEntry &ent = manifest.entry(bad[i].idx);
+		cerr << "Block " << bad[i].idx << " at " << ent.offset << " (" << ent.length << " bytes): " << bad[i].what << endl;
+	}
+	if(bad.size() > 20) cerr << "... and " << bad.size() - 20 << " more bad blocks" << endl;
+	return true;
+}
+
+// Parses "0-99,500,1000-1999" into ranges of entry numbers below 'limit'
+static bool parseSelection(const char *list, uint64_t limit, std::vector<EntryRange> &out) {
+	const char *pos = list;
+	out.clear();
+	while(*pos) {
+		char *end;
+		uint64_t first = strtoull(pos, &end, 10), last = first;
+		if(end == pos) return false;
+		if(*end == '-') {
+			pos = end + 1;
+			last = strtoull(pos, &end, 10);
+			if(end == pos || last < first) return false;
+		}
+		if(last >= limit) return false;
+		out.push_back({first, last});
+		if(*end == ',') end++;
+		else if(*end) return false;
+		pos = end;
+	}
+	return !out.empty();
+}
+
+// Adds the devices a -d names: a path, an emu:// spec, or a glob such as "/dev/sd[b-z]" (each device once)
+static bool addDevices(const char *arg, std::vector<std::string> &paths) {
+	std::vector<std::string> found;
+	if(FileEmu::isSpec(arg) || strpbrk(arg, "*?[") == nullptr) found.push_back(arg);
+	else {
+		glob_t matches;
+		if(glob(arg, 0, nullptr, &matches) == 0) for(size_t i = 0; i < matches.gl_pathc; i++) found.push_back(matches.gl_pathv[i]);
+		globfree(&matches);
+	}
+	for(auto &iter : found) if(std::find(paths.begin(), paths.end(), iter) == paths.end()) paths.push_back(iter);
+	return !found.empty();
+}
+
+// Indices of the values far from their peers: a robust z-score (distance from the median in units
+// of 1.4826 * median absolute deviation) beyond 3.5. Unlike the mean and standard deviation, one
+// slow device can't hide itself by dragging those along. 'spread' is kept at 1% of the median or
+// more so that a set of identical devices doesn't flag its noise. Needs three values or more.
+static std::vector<size_t> findOutliers(const std::vector<double> &values, double &median) {
+	auto medianOf = [](std::vector<double> v) {
+		std::sort(v.begin(), v.end());
+		return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+	};
+	std::vector<size_t> res;
+	if(values.size() < 3) return res;
+	median = medianOf(values);
+	std::vector<double> dev;
+	for(auto iter : values) dev.push_back(fabs(iter - median));
+	double spread = std::max(1.4826 * medianOf(dev), 0.01 * median);
+	for(size_t i = 0; i < values.size(); i++) if(fabs(values[i] - median) > 3.5 * spread) res.push_back(i);
+	return res;
+}
+
+#define doUsage(errStream) { cerr << errStream << endl << "Usage: " << argv[0] << " [-d <device=/dev/nbd0|emu://size=1G,...|glob>]... [-s <diskSizeInMB=auto>] [-b <bufSizeInKB=64>] [-l <locCount=1000>] [-p <numPasses=3>] [-j <threads=1>] [-S <seed=1>] [--json <file>] [--baseline <file>] [--tolerance <pct=5>] [--hugepages] [--mlock] [-F [-q <ioDepth=4>]] [-M <manifest>] [-V <manifest> [--select <list>]] [--stamp] [-h] [-r]" << endl \
+	<< "  -F sweeps the whole device instead of -l locations: every block of -b KB (default 4096 here) is written and then verified, streaming with -j generator/verifier threads and -q I/Os in flight" << endl \
+	<< "  -M saves the seed, locations and CRC32C of every block the last pass wrote; -V checks the device against such a manifest later (only entries 'list', such as 0-99,500, with --select)" << endl \
+	<< "  -d can be given many times, or as a glob such as '/dev/sd[b-z]': the devices are then checked at the same time with -j threads each and shared verifiers, and reported one by one and together" << endl \
+	<< "  --stamp starts every 4KB written with its offset, seed, pass and a CRC32C, so a bad block says what it holds instead (verify a stamped run with --stamp too)" << endl; return -1; }
+enum { OPT_HUGEPAGES = OPT_RESULTS_END, OPT_MLOCK, OPT_SELECT, OPT_STAMP };
+static const struct option longOptions[] = {
+	RESULTS_LONG_OPTIONS,
+	{ "hugepages", no_argument, nullptr, OPT_HUGEPAGES },
+	{ "mlock", no_argument, nullptr, OPT_MLOCK },
+	{ "select", required_argument, nullptr, OPT_SELECT },
+	{ "stamp", no_argument, nullptr, OPT_STAMP },
+	{ nullptr, 0, nullptr, 0 }
+};
+
 int main(int argc, char *argv[]) {
 	int opt;
 	bool readOnly = false;
@@ -104,15 +667,34 @@ int main(int argc, char *argv[]) {
 	size_t bufSize = 64*1024;
 	uint32_t locCnt = 1000;
 	uint8_t numPasses = 3;
-	std::string diskPath = "/dev/nbd0";
-	while ((opt = getopt(argc, argv, "b:d:s:l:p:rh")) != -1) {
+	uint8_t numThreads = 1;
+	uint64_t seed = 1;
+	bool sweep = false;
+	bool bufSet = false;
+	bool stamped = false;
+	unsigned ioDepth = 4;
+	std::string manifestPath, verifyPath, selection;
+	std::vector<std::string> diskPaths;
+	ResultsOptions resultsOpts;
+	while ((opt = getopt_long(argc, argv, "b:d:s:l:p:j:S:Fq:M:V:rh", longOptions, nullptr)) != -1) {
 		switch (opt) {
-			case 'b': bufSize = (size_t)atoi(optarg) * 1024; break;
-			case 'd': diskPath = optarg; break;
+			case 'b': bufSize = (size_t)atoi(optarg) * 1024; bufSet = true; break;
+			case 'F': sweep = true; break;
+			case 'q': ioDepth = (unsigned)atoi(optarg); break;
+			case 'M': manifestPath = optarg; break;
+			case 'V': verifyPath = optarg; break;
+			case OPT_SELECT: selection = optarg; break;
+			case OPT_STAMP: stamped = true; break;
+			case 'd': if(!addDevices(optarg, diskPaths)) doUsage("No device matches " << optarg); break;
 			case 's': diskSize = (size_t)atoi(optarg) * 1024 * 1024; break;
 			case 'l': locCnt = (uint32_t)atoi(optarg); break;
 			case 'p': numPasses = (uint8_t)atoi(optarg); break;
+			case 'j': numThreads = (uint8_t)atoi(optarg); break;
+			case 'S': seed = strtoull(optarg,nullptr,0); break;
 			case 'r': readOnly = true; break;
+			case OPT_JSON: case OPT_BASELINE: case OPT_TOLERANCE: resultsOpts.parse(opt, optarg); break;
+			case OPT_HUGEPAGES: BufferArena::setHugePages(true); break;
+			case OPT_MLOCK: BufferArena::setLocked(true); break;
 			case 'h': doUsage("Help requested"); return -1;
 			default:  doUsage("Unknown argument"); return -1;
 		}
@@ -120,40 +702,216 @@ int main(int argc, char *argv[]) {
 	if(optind < argc) { doUsage("Unknown argument: " << argv[optind]); return -1; }
 	if(locCnt == 0) doUsage("locCount must be non-zero");
 	if(numPasses == 0) doUsage("numPasses must be non-zero");
+	if(numThreads == 0) doUsage("threads must be non-zero");
 	if(numPasses > 24) doUsage("numPasses must be less than 24...because I said so.");
-	{
-		int fd;
-		if((fd = open(diskPath.c_str(),O_RDWR|O_LARGEFILE)) == -1) doUsage("Error opening " << diskPath << ": " << strerror(errno));
-		if(diskSize == 0) {
-			struct stat fd_stat;
-			if(fstat(fd,&fd_stat)) doUsage("Error getting the stats on the file: " << strerror(errno));
-			if(S_ISBLK(fd_stat.st_mode)) ioctl(fd,BLKGETSIZE64, &diskSize);
-			else {
-				cout << "File stats: blksize=" << fd_stat.st_blksize << " size=" << fd_stat.st_size << endl;
-				diskSize = fd_stat.st_size;
-			}
+	if(diskPaths.empty()) diskPaths.push_back("/dev/nbd0");
+	const bool multi = diskPaths.size() > 1;
+
+	if(ioDepth == 0) doUsage("ioDepth must be non-zero");
+	if(!manifestPath.empty() && (readOnly || !verifyPath.empty())) doUsage("-M needs a pass that writes");
+	if(multi && (!manifestPath.empty() || !verifyPath.empty())) doUsage("-M and -V work on a single device");
+	if(!selection.empty() && verifyPath.empty()) doUsage("--select only applies to -V");
+	if(sweep) {
+		if(!bufSet) bufSize = 4*1024*1024; // large enough to run a disk at its line rate
+		if(bufSize % 4096) doUsage("The sweep block size must be a multiple of 4KB for direct I/O");
+	}
+
+	std::vector<std::unique_ptr<TestDevice>> devices;
+	uint64_t totalPassBytes = 0;
+	for(auto &path : diskPaths) {
+		uint64_t size = diskSize;
+		{
+			std::unique_ptr<File> file = openFile<FileUnbuffered>(path.c_str());
+			if(file->getSize() == 0) doUsage("Error opening " << path << ": " << strerror(errno));
+			if(size == 0) size = file->getSize();
 		}
-		close(fd);
+		if(sweep) size -= size % 4096;
+		devices.push_back(std::make_unique<TestDevice>(path, size, multi ? path + ": " : ""));
+		devices.back()->out << "Setting diskSize=" << size / (1024*1024.0) << "MB, bufSize=" << bufSize << endl;
+		if(size < bufSize) doUsage( "DiskSize<"<<(uint64_t)bufSize<<", we can't deal with that.");
+		totalPassBytes += sweep ? size : (uint64_t)bufSize * locCnt;
 	}
 
-	cout << "Setting diskSize=" << diskSize / (1024*1024.0) << "MB, bufSize=" << bufSize << endl;
+	if(!verifyPath.empty()) cout << "Will be checking against " << verifyPath << endl;
+	else if(readOnly) cout << "Will be reading " << totalPassBytes / (1024*1024.0) << "MB" << endl;
+	else cout << "Will be writing+reading " << totalPassBytes / (1024*1024.0) << "MB" << endl;
+	if(multi) cout << "On " << devices.size() << " devices at the same time" << endl;
 
-	if(diskSize < bufSize) doUsage( "DiskSize<"<<(uint64_t)bufSize<<", we can't deal with that.");
+	JsonValue results = makeResults("diskSpotCheck", argc, argv);
+	JsonValue &config = results["config"];
+	if(multi) {
+		JsonValue &list = config["devices"];
+		list = JsonValue::array();
+		for(auto &iter : devices) {
+			JsonValue dev = JsonValue::object();
+			dev["path"] = iter->path;
+			dev["disk_size"] = iter->size;
+			list.push(dev);
+		}
+	} else {
+		config["device"] = devices[0]->path;
+		config["disk_size"] = devices[0]->size;
+	}
+	config["buf_size"] = (uint64_t)bufSize;
+	if(sweep) {
+		config["mode"] = "sweep";
+		config["io_depth"] = ioDepth;
+	} else config["locations"] = locCnt;
+	config["passes"] = numPasses;
+	config["threads"] = numThreads;
+	config["seed"] = seed;
+	config["read_only"] = readOnly;
+	config["stamped"] = stamped;
+	if(!manifestPath.empty()) config["manifest"] = manifestPath;
 
-	if(readOnly) cout << "Will be reading " << bufSize * locCnt / (1024*1024.0) << "MB" << endl;
-	else cout << "Will be writing+reading " << bufSize * locCnt / (1024*1024.0) << "MB" << endl;
+	if(!verifyPath.empty()) {
+		ManifestReader manifest;
+		std::string err;
+		if(!manifest.open(verifyPath, err)) { cerr << "Can't read manifest " << verifyPath << ": " << err << endl; return resultsOpts.finish(results, 1); }
+		const ManifestHeader &hdr = manifest.header();
+		std::vector<EntryRange> selected;
+		if(!selection.empty() && !parseSelection(selection.c_str(), hdr.numEntries, selected)) doUsage("Expected entry numbers below " << hdr.numEntries << " such as 0-99,500: " << selection);
+		char created[64];
+		time_t when = hdr.createdUnix;
+		strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+		cout << "Manifest of " << (hdr.sweep ? "a sweep" : "a spot check") << (hdr.stamped ? " (stamped)" : "") << " of char=" << hdr.pass << ", seed=" << hdr.seed << ", saved " << created << ": "
+			<< hdr.numEntries << " blocks of up to " << hdr.blockSize << " bytes over " << hdr.deviceSize / (1024*1024.0) << "MB" << endl;
+		config["mode"] = "manifest verify";
+		config["manifest"] = verifyPath;
+		config["seed"] = hdr.seed;
+		config["stamped"] = hdr.stamped != 0;
+		if(!selection.empty()) config["select"] = selection;
+		ManifestCheck check;
+		if(!verifyManifest(devices[0]->path, manifest, selected, numThreads, ioDepth, check)) return resultsOpts.finish(results, 1);
+		cout << "Checked " << check.checked << " blocks (" << check.bytes / (1024*1024.0) << "MB) at " << check.speed << " MB/s: "
+			<< check.mismatches << " bad, " << check.readErrors << " unreadable, " << check.badEntries << " bad manifest entries" << endl;
+		JsonValue phase = JsonValue::object();
+		phase["name"] = "manifest verify";
+		phase["metrics"]["speed_MBps"] = makeMetric(check.speed, "MB/s", true);
+		phase["metrics"]["bad_blocks"] = makeMetric((double)(check.mismatches + check.readErrors), "blocks", false);
+		results["phases"].push(phase);
+		if(check.mismatches + check.readErrors + check.badEntries == 0) return resultsOpts.finish(results, 0);
+		std::ostringstream os;
+		os << check.mismatches << " blocks failed their checksum and " << check.readErrors << " could not be read";
+		if(check.badEntries) os << "; " << check.badEntries << " manifest entries point outside the block size or the device";
+		results["errors"].push(os.str());
+		cerr << "Failed verification against the manifest" << endl;
+		return resultsOpts.finish(results, -4);
+	}
 
-	double curSpeed, totSpeed = 0;
-	auto startT = std::chrono::steady_clock::now();
-	if(readOnly) {
-		if((totSpeed = doPass(diskPath,'a'+numPasses-1,diskSize,bufSize,readOnly,locCnt)) < 0) { cerr << "Failed a test" << endl; return -1; }
-	} else {
-		for(int i = 0; i < numPasses; i++) {
-			if((curSpeed = doPass(diskPath,'a'+i,diskSize,bufSize,readOnly,locCnt)) < 0) { cerr << "Failed a test" << endl; return -1; }
-			totSpeed += curSpeed;
+	// one device keeps its -j verifiers; several share enough to keep every CPU busy
+	unsigned numVerifiers = numThreads;
+	if(multi) numVerifiers = std::max<unsigned>(numThreads, std::min<unsigned>(numThreads * devices.size(), std::thread::hardware_concurrency()));
+	VerifyPool pool(numVerifiers);
+	Manifest manifest;
+	auto runPass = [&](TestDevice &dev, char c) {
+		double writeSpeed = 0, verifySpeed = 0;
+		Manifest *saving = manifestPath.empty() ? nullptr : &manifest;
+		double speed = sweep ? doSweep(dev,pool,seed,c,bufSize,readOnly,numThreads,ioDepth,writeSpeed,verifySpeed,saving,stamped)
+			: doPass(dev,pool,seed,c,bufSize,readOnly,locCnt,numThreads,saving,stamped);
+		std::string err;
+		if(speed >= 0 && saving && !manifest.save(manifestPath, err)) {
+			dev.err << "Can't save the manifest " << manifestPath << ": " << err << endl;
+			speed = -1;
 		}
-	}
+		std::string label = multi ? dev.path + ':' : std::string();
+		JsonValue phase = JsonValue::object();
+		phase["name"] = label + "pass " + c;
+		phase["metrics"] = JsonValue::object();
+		if(speed >= 0) {
+			phase["metrics"]["speed_MBps"] = makeMetric(speed, "MB/s", true);
+			if(sweep) {
+				if(!readOnly) phase["metrics"]["write_MBps"] = makeMetric(writeSpeed, "MB/s", true);
+				phase["metrics"]["verify_MBps"] = makeMetric(verifySpeed, "MB/s", true);
+			}
+		} else {
+			std::ostringstream os;
+			os << label << "pass " << c << " failed with code " << speed;
+			dev.errors.push(os.str());
+		}
+		dev.phases.push(phase);
+		return speed;
+	};
+	// Runs every pass on one device, stopping at the first that fails
+	auto runDevice = [&](TestDevice &dev) {
+		auto startT = std::chrono::steady_clock::now();
+		double curSpeed;
+		for(int i = readOnly ? numPasses - 1 : 0; i < numPasses; i++) {
+			if((curSpeed = runPass(dev, 'a'+i)) < 0) { dev.err << "Failed a test" << endl; dev.failed = true; return; }
+			dev.speeds.push_back(curSpeed);
+		}
+		dev.duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
+		double totSpeed = 0;
+		for(auto iter : dev.speeds) totSpeed += iter;
+		dev.out << "All tests completed in " << dev.duration << " seconds. Average speed=" << (totSpeed / dev.speeds.size()) << "MB/s." << endl;
+	};
+
+	auto startT = std::chrono::steady_clock::now();
+	if(multi) {
+		std::vector<std::thread> runners;
+		for(auto &iter : devices) runners.emplace_back([&runDevice](TestDevice *dev) { runDevice(*dev); }, iter.get());
+		for(auto &iter : runners) iter.join();
+	} else runDevice(*devices[0]);
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
-	cout << "All tests completed in " << duration << " seconds. Average speed=" << (totSpeed / numPasses) << "MB/s." << endl;
-	return 0;
+	for(auto &iter : devices) {
+		for(size_t i = 0; i < iter->phases.size(); i++) results["phases"].push(iter->phases.at(i));
+		for(size_t i = 0; i < iter->errors.size(); i++) results["errors"].push(iter->errors.at(i));
+	}
+
+	if(!multi) {
+		TestDevice &dev = *devices[0];
+		if(dev.failed) return resultsOpts.finish(results, -1);
+		double totSpeed = 0;
+		for(auto iter : dev.speeds) totSpeed += iter;
+		JsonValue all = JsonValue::object();
+		all["name"] = "all";
+		all["metrics"]["avg_speed_MBps"] = makeMetric(totSpeed / dev.speeds.size(), "MB/s", true, dev.speeds);
+		all["metrics"]["duration_s"] = makeMetric(duration, "s", false);
+		results["phases"].push(all);
+		return resultsOpts.finish(results, 0);
+	}
+
+	// Each device on its own, then the host as a whole: the passes ran side by side, so what the host
+	// moved through its controllers at once is everything the devices tested over the wall time
+	std::vector<double> devSpeeds;
+	uint64_t totBytes = 0;
+	std::vector<TestDevice *> passed;
+	cout << "Results:" << endl;
+	for(auto &iter : devices) {
+		TestDevice &dev = *iter;
+		if(dev.failed) { cout << "  " << dev.path << ": FAILED" << endl; continue; }
+		double totSpeed = 0;
+		for(auto speed : dev.speeds) totSpeed += speed;
+		double avg = totSpeed / dev.speeds.size();
+		cout << "  " << dev.path << ": " << avg << " MB/s over " << dev.speeds.size() << " passes in " << dev.duration << " seconds" << endl;
+		JsonValue phase = JsonValue::object();
+		phase["name"] = dev.path + ":all";
+		phase["metrics"]["avg_speed_MBps"] = makeMetric(avg, "MB/s", true, dev.speeds);
+		phase["metrics"]["duration_s"] = makeMetric(dev.duration, "s", false);
+		results["phases"].push(phase);
+		devSpeeds.push_back(avg);
+		totBytes += dev.bytes;
+		passed.push_back(&dev);
+	}
+	double aggregate = duration > 0 ? totBytes / duration / (1024*1024) : 0;
+	cout << "Aggregate: " << aggregate << " MB/s from " << passed.size() << " of " << devices.size() << " devices in " << duration << " seconds" << endl;
+	JsonValue all = JsonValue::object();
+	all["name"] = "all";
+	all["metrics"]["aggregate_MBps"] = makeMetric(aggregate, "MB/s", true);
+	all["metrics"]["duration_s"] = makeMetric(duration, "s", false);
+	results["phases"].push(all);
+
+	double median = 0;
+	JsonValue &outliers = results["outliers"];
+	outliers = JsonValue::array();
+	for(auto i : findOutliers(devSpeeds, median)) {
+		cout << "Warning: " << passed[i]->path << " is an outlier at " << devSpeeds[i] << " MB/s, " << (devSpeeds[i] < median ? "slower" : "faster") << " than the median of " << median << " MB/s" << endl;
+		JsonValue out = JsonValue::object();
+		out["device"] = passed[i]->path;
+		out["speed_MBps"] = devSpeeds[i];
+		out["median_MBps"] = median;
+		outliers.push(out);
+	}
+	if(passed.size() < devices.size()) { cerr << "Failed a test on " << devices.size() - passed.size() << " devices" << endl; return resultsOpts.finish(results, -1); }
+	return resultsOpts.finish(results, 0);
 }
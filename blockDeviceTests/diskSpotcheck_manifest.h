@@ -0,0 +1,137 @@
+/* Test program created by: Fekete, Andras
+	 Copyright 2016
+	 This program writes a set of random byte sequences in random locations on
+	 the nbd disk and then reads them back to make sure they're correctly written.
+
+	 This program is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 This program is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKSPOTCHECK_MANIFEST_H
+#define DISKSPOTCHECK_MANIFEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+// Manifest file: one ManifestHeader, then one ManifestEntry per written block in
+// the order they were scheduled. Host byte order, like the trace files.
+struct ManifestHeader {
+	char magic[8];        // "DSCMANIF"
+	uint32_t version;     // MANIFEST_VERSION
+	uint32_t entrySize;   // sizeof(ManifestEntry)
+	uint64_t seed;
+	uint64_t deviceSize;  // size the pass was run over
+	uint64_t numEntries;
+	uint32_t blockSize;   // bufSize of a spot check, block size of a sweep
+	char pass;            // pattern char of the pass that wrote the data
+	uint8_t sweep;        // 1 if every block of the device was written
+	uint8_t stamped;      // 1 if the blocks carry BlockStamps
+	uint8_t reserved0;
+	uint64_t createdUnix; // when the manifest was saved
+	uint64_t reserved;
+};
+static_assert(sizeof(ManifestHeader) == 64, "manifest header layout");
+#define MANIFEST_MAGIC "DSCMANIF"
+#define MANIFEST_VERSION 1
+
+struct ManifestEntry {
+	uint64_t offset;
+	uint32_t length;
+	uint32_t crc;         // CRC32C of the data written there
+};
+static_assert(sizeof(ManifestEntry) == 16, "manifest entry layout");
+
+// Filled in by the writers of a pass (each entry by whoever wrote that block) and saved once the pass checks out
+class Manifest {
+public:
+	void begin(uint64_t seed, char pass, uint64_t deviceSize, uint32_t blockSize, bool sweep, uint64_t numEntries, bool stamped) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+		header.version = MANIFEST_VERSION;
+		header.entrySize = sizeof(ManifestEntry);
+		header.seed = seed;
+		header.deviceSize = deviceSize;
+		header.numEntries = numEntries;
+		header.blockSize = blockSize;
+		header.pass = pass;
+		header.sweep = sweep;
+		header.stamped = stamped;
+		entries.assign(numEntries, ManifestEntry());
+	}
+	inline void set(uint64_t idx, uint64_t offset, uint32_t length, uint32_t crc) { entries[idx] = { offset, length, crc }; }
+
+	// Written to a temporary name and renamed, so an interrupted save never leaves a half manifest behind
+	bool save(const std::string &path, std::string &err) {
+		header.createdUnix = time(nullptr);
+		std::string tmp = path + ".tmp";
+		FILE *fp = fopen(tmp.c_str(), "wb");
+		if(fp == nullptr) { err = strerror(errno); return false; }
+		bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(entries.data(), sizeof(ManifestEntry), entries.size(), fp) == entries.size();
+		ok = fflush(fp) == 0 && fsync(fileno(fp)) == 0 && ok;
+		if(!ok) err = strerror(errno);
+		if(fclose(fp) != 0 && ok) { ok = false; err = strerror(errno); }
+		if(ok && rename(tmp.c_str(), path.c_str()) != 0) { ok = false; err = strerror(errno); }
+		if(!ok) unlink(tmp.c_str());
+		return ok;
+	}
+
+private:
+	ManifestHeader header;
+	std::vector<ManifestEntry> entries;
+};
+
+// Read-only view of a manifest file, mapped like a trace so that a large one streams in
+class ManifestReader {
+public:
+	ManifestReader() { }
+	ManifestReader(const ManifestReader &) = delete;
+	ManifestReader &operator=(const ManifestReader &) = delete;
+	~ManifestReader() { if(mem != nullptr) munmap(mem, size); }
+
+	bool open(const std::string &path, std::string &err) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0) { err = strerror(errno); return false; }
+		struct stat st;
+		if(fstat(fd, &st) != 0) { err = strerror(errno); ::close(fd); return false; }
+		size = st.st_size;
+		if(size < sizeof(ManifestHeader)) { err = "too short for a manifest"; ::close(fd); return false; }
+		void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(addr == MAP_FAILED) { err = strerror(errno); return false; }
+		mem = (char *) addr;
+		madvise(mem, size, MADV_SEQUENTIAL);
+		const ManifestHeader &hdr = header();
+		if(memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) != 0) { err = "not a manifest file"; return false; }
+		if(hdr.version != MANIFEST_VERSION || hdr.entrySize != sizeof(ManifestEntry)) { err = "unsupported manifest version"; return false; }
+		if(size < sizeof(ManifestHeader) + hdr.numEntries * sizeof(ManifestEntry)) { err = "manifest is truncated"; return false; }
+		return true;
+	}
+
+	const ManifestHeader &header() const { return *(const ManifestHeader *) mem; }
+	uint64_t numEntries() const { return header().numEntries; }
+	const ManifestEntry &entry(uint64_t idx) const { return ((const ManifestEntry *) (mem + sizeof(ManifestHeader)))[idx]; }
+
+private:
+	char *mem = nullptr;
+	size_t size = 0;
+};
+
+#endif
@@ -28,8 +28,11 @@
 #include <chrono>
 #include <future>
 #include <set>
+#include <thread>
+#include <getopt.h>
 #include "../File.h"
 #include "diskSystemTest_tests.h"
+#include "diskSystemTest_jobs.h"
 using namespace std;
 
 template<typename T>
@@ -40,38 +43,162 @@ void usage(char *progName) {
 	cout << "Usage: " << progName << " <OPTIONS>* <testFilePath>" << endl;
 	cout << "OPTIONS:" << endl;
 	cout << "\t-c <sizeInMB>  => Do random reads until 'sizeInMB' has been read to clear caches" << endl;
+	cout << "\t-E             => Evict the tested region from the page cache (posix_fadvise, or BLKFLSBUF for a whole block device)" << endl;
+	cout << "\t-H             => Report how much of the working set is in the page cache" << endl;
+	cout << "\t-W <hitPct>[:<seconds>] => Read locations as the next phase would until 'hitPct'% of its accesses would hit the page cache (giving up after 'seconds', default=300)" << endl;
 	cout << "\t-w <minutes>   => Write for 'minutes' minutes" << endl;
 	cout << "\t-r <minutes>   => Read for 'minutes' minutes" << endl;
+	cout << "\t-m <minutes>   => Read and write together for 'minutes' minutes, in the ratio set by -M" << endl;
+	cout << "\t-M <readPct>[:<readKB>:<writeKB>] => Make 'readPct'% of the -m ops reads (default=70), optionally capping each op type's size in KB" << endl;
+	cout << "\t-L <iops>[:poisson] => Send 'iops' requests per second in total on a fixed (or Poisson) schedule and measure latency from the intended send time (0 = as fast as possible, the default)" << endl;
 	cout << "\t-p <percent>   => Set the percent of disk to be accessed (default=1.0%)" << endl;
 	cout << "\t-P <percent>   => Update 'percent'% of the access locations" << endl;
+	cout << "\t-C             => Compute access locations on demand instead of storing them (for large -p on large devices)" << endl;
+	cout << "\t-D <spec>      => Pick locations by 'spec': uniform (default), zipf[:theta], hotcold[:hotPct[:accessPct]], seq, stride:<n> or streams:<n>" << endl;
 	cout << "\t-t <num>       => Use 'num' threads in transactions" << endl;
 	cout << "\t-b             => Set BUFFERED file access mode" << endl;
 	cout << "\t-u             => Set UNBUFFERED file access mode (default)" << endl;
 	cout << "\t-d             => Set DIRECT file access mode" << endl;
+	cout << "\t-i             => Set IO_URING file access mode (direct, asynchronous)" << endl;
+	cout << "\t-x             => Set MMAP file access mode (loads and stores on a shared mapping, I/O through page faults)" << endl;
+	cout << "\t-q <depth>     => Keep 'depth' requests in flight per thread in IO_URING mode (default=32)" << endl;
 	cout << "\t-s <seconds>   => Sleep until 'seconds' seconds" << endl;
+	cout << "\t-I <ms>        => Sample throughput and latency every 'ms' milliseconds while a test runs" << endl;
+	cout << "\t-S <file>      => Write samples to 'file' instead of stdout (JSON lines if it ends in .json, else CSV)" << endl;
 	cout << "\t-T             => Test THROUGHPUT" << endl;
 	cout << "\t-R <numChunks> => Test RESPONSETIME (default)" << endl;
+	cout << "\t-j <jobFile>   => Run the jobs of 'jobFile' at the same time, each with its own test, access mode, threads, rate and region (see README)" << endl;
+	cout << "\t--cpus <list>      => Pin worker i to the i-th CPU of 'list' (such as 0-3,8), wrapping around; workers and their buffers persist across phases" << endl;
+	cout << "\t--mmap-opts <list> => Options for -x, comma separated: populate, random, sequential, willneed, normal, sync (msync every write)" << endl;
+	cout << "\t--hugepages        => Back I/O buffers with 2MB hugepages (transparent ones if none are reserved); give it before the first test" << endl;
+	cout << "\t--mlock            => Lock I/O buffers in memory; give it before the first test" << endl;
+	cout << "\t--trace <file>     => Record every op of the following tests to the binary trace 'file'" << endl;
+	cout << "\t--replay <file>    => Replay the trace 'file' with -t threads in the current access mode; each recorded worker's ops stay in order" << endl;
+	cout << "\t--replay-speed <x> => Replay at 'x' times the recorded speed, 0 = as fast as possible (default=1)" << endl;
+	cout << "\t--json <file>      => Write the configuration and results of every test as JSON to 'file'" << endl;
+	cout << "\t--baseline <file>  => Compare against the JSON results in 'file' and exit with 2 on a regression" << endl;
+	cout << "\t--tolerance <pct>  => Changes smaller than 'pct' percent are never a regression (default=5)" << endl;
 	cout << "Note: Multiple options can be passed multiple times. Such as " << progName << " -w 10 -r 10 -p 10.5 -r 10" << endl;
-	cout << "Note: Percent can be 0 to 100 inclusive, but I would not go past 80%. The way the locations get generated may take a long time to complete." << endl;
+	cout << "Note: Percent can be 0 to 100 inclusive." << endl;
+	cout << "Note: 'testFilePath' can be an emulated device such as emu://size=1T,lat=80us,channels=8 (see File.h for all keys)." << endl;
 	cout << "Chunk size = " << CHUNK_SIZE << endl;
 }
 
+static const char *accessModeName(Test::File_t type) {
+	switch(type) {
+		case Test::FILE_DIRECT: return "direct";
+		case Test::FILE_BUFFERED: return "buffered";
+		case Test::FILE_UNBUFFERED: return "unbuffered";
+		case Test::FILE_IOURING: return "io_uring";
+		case Test::FILE_MMAP: return "mmap";
+	}
+	return "unknown";
+}
+
+enum { OPT_CPUS = OPT_RESULTS_END, OPT_HUGEPAGES, OPT_MLOCK, OPT_MMAP_OPTS, OPT_TRACE, OPT_REPLAY, OPT_REPLAY_SPEED };
+static const struct option longOptions[] = {
+	RESULTS_LONG_OPTIONS,
+	{ "cpus", required_argument, nullptr, OPT_CPUS },
+	{ "hugepages", no_argument, nullptr, OPT_HUGEPAGES },
+	{ "mlock", no_argument, nullptr, OPT_MLOCK },
+	{ "mmap-opts", required_argument, nullptr, OPT_MMAP_OPTS },
+	{ "trace", required_argument, nullptr, OPT_TRACE },
+	{ "replay", required_argument, nullptr, OPT_REPLAY },
+	{ "replay-speed", required_argument, nullptr, OPT_REPLAY_SPEED },
+	{ nullptr, 0, nullptr, 0 }
+};
+
 int main( int argc, char* argv[] ) {
 	int opt;
 
 	if(argc < 3) { usage(argv[0]); return 0; }
 	{
-		FileUnbuffered file(argv[argc-1]);
-		if (file.getSize() == 0) { cerr << "Can't open file: " << argv[argc-1] << endl; return 0; }
+		std::unique_ptr<File> file = openFile<FileUnbuffered>(argv[argc-1]);
+		if (file->getSize() == 0) { cerr << "Can't open file: " << argv[argc-1] << endl; return 0; }
+		// locations are whole chunks, so a smaller file has none to test (nor to place -C locations in)
+		if (file->getSize() < CHUNK_SIZE) { cerr << "File is smaller than one " << CHUNK_SIZE / 1024 << "KB chunk: " << argv[argc-1] << endl; return 1; }
 	}
 
 	uint8_t numThreads = 10;
+	unsigned queueDepth = 32;
+	unsigned sampleMs = 0;
+	bool sampleJson = false;
+	bool compactLocs = false;
+	AccessDist dist;
+	MmapOptions mmapOpts;
+	Workload mix(70.0, 0, 0);
+	double targetIops = 0;
+	std::string cpuList;
+	bool poisson = false;
+	auto paced = [&](Workload work) { work.targetIops = targetIops; work.poisson = poisson; return work; };
+	std::ofstream sampleFile;
+	std::ostream *sampleOut = &cout;
+	bool sampleHeaderDone = false;
 	double percent = 1.0;
 	Test::File_t type = Test::FILE_UNBUFFERED;
+	WorkerPool pool; // outlives every test so its threads and their buffers carry over between phases
+	TraceWriter traceOut;
+	double replaySpeed = 1;
 	std::unique_ptr<Test> test = make_unique<Test_Throughput>(argv[argc-1]);
+	test->setWorkerPool(&pool);
+	std::string testName = "throughput";
+	test->setDistribution(dist);
+	test->setCompactLocs(compactLocs);
 	test->generateLocs(percent);
 
-	while ((opt = getopt(argc-1, argv, "c:w:r:p:P:t:buds:TR:")) != -1) {
+	double cacheHitPct = -1; // measured by -E/-H/-W for the next phase's configuration
+	auto reportCache = [&]() -> bool {
+		double spread, byAccess;
+		if(!test->cacheResidency(false, spread) || !test->cacheResidency(true, byAccess)) {
+			cout << "no page cache information: " << strerror(errno) << endl;
+			return false;
+		}
+		cout << spread << "% of the working set cached, expected hit ratio " << byAccess << '%' << endl;
+		cacheHitPct = byAccess;
+		return true;
+	};
+	ResultsOptions resultsOpts;
+	JsonValue results = makeResults("diskSystemTest", argc, argv);
+	results["config"]["device"] = argv[argc-1];
+	results["config"]["chunk_size"] = CHUNK_SIZE;
+	auto pushPhase = [&](JsonValue &phase, const std::string &name) {
+		phase["name"] = name;
+		const JsonValue *errors = phase.find("errors");
+		for(size_t i = 0; errors && i < errors->size(); i++) results["errors"].push(name + ": " + errors->at(i).str());
+		results["phases"].push(phase);
+	};
+	// 'extra' adds to the phase's configuration
+	auto recordPhase = [&](const char *op, unsigned minutes, Test &from, const std::string &fromName, const JsonValue &extra = JsonValue()) {
+		JsonValue phase = from.getLastResult();
+		std::ostringstream name;
+		name << results["phases"].size() + 1 << ':' << op << ':' << fromName;
+		JsonValue &config = phase["config"];
+		config["test"] = fromName;
+		config["access_mode"] = accessModeName(type);
+		config["threads"] = numThreads;
+		config["queue_depth"] = queueDepth;
+		if(type == Test::FILE_MMAP) config["mmap_options"] = mmapOpts.spec;
+		config["percent"] = percent;
+		config["compact_locations"] = compactLocs;
+		if(!cpuList.empty()) config["cpus"] = cpuList;
+		config["distribution"] = dist.getSpec();
+		config["minutes"] = minutes;
+		if(targetIops > 0) {
+			config["target_iops"] = targetIops;
+			config["arrivals"] = poisson ? "poisson" : "fixed";
+		}
+		if(std::string(op) == "mixed") {
+			config["read_pct"] = mix.readPct;
+			config["read_kb"] = mix.readChunks * CHUNK_SIZE / 1024;
+			config["write_kb"] = mix.writeChunks * CHUNK_SIZE / 1024;
+		}
+		if(cacheHitPct >= 0) config["cache_hit_pct_before"] = cacheHitPct;
+		cacheHitPct = -1;
+		for(auto &iter : extra.members()) config[iter.first] = iter.second;
+		pushPhase(phase, name.str());
+	};
+
+	while ((opt = getopt_long(argc-1, argv, "c:EHW:w:r:m:M:L:p:P:CD:t:budixq:s:I:S:TR:j:", longOptions, nullptr)) != -1) {
 		switch (opt) {
 			case 'c': {
 					uint8_t seconds = atoi(optarg);
@@ -81,16 +208,66 @@ int main( int argc, char* argv[] ) {
 					cout << "done: " << toMB(sizeRead) << "MB read" << endl;
 				}
 				break;
+			case 'E':
+				cout << "Evicting the tested region from the page cache..." << flush;
+				if(!test->evictCache()) { cout << "failed: " << strerror(errno) << endl; break; }
+				cout << "done: ";
+				reportCache();
+				break;
+			case 'H':
+				cout << "Page cache: ";
+				reportCache();
+				break;
+			case 'W': {
+					double target = atof(optarg);
+					const char *colon = strchr(optarg, ':');
+					unsigned seconds = colon ? atoi(colon + 1) : 300;
+					cout << "Warming the page cache to a " << target << "% hit ratio..." << flush;
+					double reached;
+					int64_t sizeRead = test->warmCache(target, std::chrono::steady_clock::now() + std::chrono::seconds(seconds), reached);
+					if(sizeRead == -1) { cout << "failed: " << strerror(errno) << endl; break; }
+					cout << "done: " << toMB(sizeRead) << "MB read, expected hit ratio " << reached << '%' << (reached < target ? " (gave up)" : "") << endl;
+					cacheHitPct = reached;
+				}
+				break;
 			case 'w': {
 					uint8_t minutes = atoi(optarg);
 					cout << "Write test " << (int)numThreads << " threads for " << (int)minutes << "min..." << flush;
-					cout << "done: " << test->do_testAsString(std::chrono::steady_clock::now() + std::chrono::minutes(minutes),false, numThreads,type) << endl;
+					cout << "done: " << test->do_testAsString(std::chrono::steady_clock::now() + std::chrono::minutes(minutes),paced(false), numThreads,type,queueDepth) << endl;
+					recordPhase("write", minutes, *test, testName);
 				}
 				break;
 			case 'r': {
 					uint8_t minutes = atoi(optarg);
 					cout << "Read test " << (int)numThreads << " threads for " << (int)minutes << "min..." << flush;
-					cout << "done: " << test->do_testAsString(std::chrono::steady_clock::now() + std::chrono::minutes(minutes),true, numThreads,type) << endl;
+					cout << "done: " << test->do_testAsString(std::chrono::steady_clock::now() + std::chrono::minutes(minutes),paced(true), numThreads,type,queueDepth) << endl;
+					recordPhase("read", minutes, *test, testName);
+				}
+				break;
+			case 'm': {
+					uint8_t minutes = atoi(optarg);
+					cout << "Mixed test " << mix.readPct << "% reads " << (int)numThreads << " threads for " << (int)minutes << "min..." << flush;
+					cout << "done: " << test->do_testAsString(std::chrono::steady_clock::now() + std::chrono::minutes(minutes),paced(mix), numThreads,type,queueDepth) << endl;
+					recordPhase("mixed", minutes, *test, testName);
+				}
+				break;
+			case 'M': {
+					unsigned readKB = 0, writeKB = 0;
+					double readPct = atof(optarg);
+					const char *sizes = strchr(optarg, ':');
+					if(sizes && sscanf(sizes, ":%u:%u", &readKB, &writeKB) != 2) { cerr << "Expected <readPct>:<readKB>:<writeKB>: " << optarg << endl; return 1; }
+					if((readPct < 0) || (readPct > 100)) { cerr << "Read percent should be between 0 and 100: " << optarg << endl; return 1; }
+					if(readKB % (CHUNK_SIZE/1024) || writeKB % (CHUNK_SIZE/1024) || readKB / (CHUNK_SIZE/1024) > UINT8_MAX || writeKB / (CHUNK_SIZE/1024) > UINT8_MAX) {
+						cerr << "Op sizes should be multiples of " << CHUNK_SIZE/1024 << "KB up to " << UINT8_MAX * CHUNK_SIZE / 1024 << "KB: " << optarg << endl; return 1;
+					}
+					mix = Workload(readPct, readKB / (CHUNK_SIZE/1024), writeKB / (CHUNK_SIZE/1024));
+				}
+				break;
+			case 'L': {
+					const char *arrivals = strchr(optarg, ':');
+					targetIops = atof(optarg);
+					poisson = arrivals && strcmp(arrivals, ":poisson") == 0;
+					if(targetIops < 0 || (arrivals && !poisson && strcmp(arrivals, ":fixed") != 0)) { cerr << "Expected <iops>[:poisson|:fixed]: " << optarg << endl; return 1; }
 				}
 				break;
 			case 'p': {
@@ -110,10 +287,28 @@ int main( int argc, char* argv[] ) {
 					cout << "done: " << endl;
 				}
 				break;
+			case 'C':
+				cout << "Switching to compact locations..." << flush;
+				compactLocs = true;
+				test->setCompactLocs(true);
+				test->generateLocs(percent);
+				cout << "done" << endl;
+				break;
+			case 'D':
+				if(!AccessDist::parse(optarg, dist)) { cerr << "Unknown distribution: " << optarg << endl; usage(argv[0]); return 1; }
+				if(compactLocs && dist.isSequential()) cerr << "Warning: with -C locations are numbered in a random order, so " << optarg << " is not sequential on the device" << endl;
+				test->setDistribution(dist);
+				break;
 			case 't': numThreads = atoi(optarg); break;
 			case 'b': type = Test::FILE_BUFFERED; break;
 			case 'u': type = Test::FILE_UNBUFFERED; break;
 			case 'd': type = Test::FILE_DIRECT; break;
+			case 'i': type = Test::FILE_IOURING; break;
+			case 'x': type = Test::FILE_MMAP; break;
+			case 'q':
+				queueDepth = atoi(optarg);
+				if(queueDepth == 0) { cerr << "Queue depth must be non-zero: " << optarg << endl; queueDepth = 1; }
+				break;
 			case 's': {
 					int seconds = atoi(optarg);
 					cout << "Sleep for " << (int)seconds << "s..." << flush;
@@ -121,20 +316,163 @@ int main( int argc, char* argv[] ) {
 					cout << "done" << endl;
 				}
 				break;
+			case 'I':
+				sampleMs = atoi(optarg);
+				if(sampleMs && !sampleJson && !sampleHeaderDone) { *sampleOut << Test::sampleCsvHeader() << endl; sampleHeaderDone = true; }
+				test->setSampling(sampleMs,sampleOut,sampleJson);
+				break;
+			case 'S': {
+					std::string fileName = optarg;
+					sampleFile.open(fileName, std::ofstream::out | std::ofstream::trunc);
+					if(!sampleFile.is_open()) { cerr << "Can't open sample file: " << fileName << endl; return 1; }
+					sampleOut = &sampleFile;
+					sampleJson = (fileName.size() > 5) && (fileName.compare(fileName.size() - 5, 5, ".json") == 0);
+					sampleHeaderDone = false;
+					if(sampleMs && !sampleJson) { *sampleOut << Test::sampleCsvHeader() << endl; sampleHeaderDone = true; }
+					test->setSampling(sampleMs,sampleOut,sampleJson);
+				}
+				break;
 			case 'T':
 				cout << "Setting test: Throughput..." << flush;
 				test = make_unique<Test_Throughput>(argv[argc-1]);
+				testName = "throughput";
+				test->setWorkerPool(&pool);
+				test->setDistribution(dist);
+				test->setMmapOptions(mmapOpts);
+				test->setTrace(traceOut.isOpen() ? &traceOut : nullptr);
+				test->setCompactLocs(compactLocs);
 				test->generateLocs(percent);
+				test->setSampling(sampleMs,sampleOut,sampleJson);
 				cout << "done" << endl;
 				break;
 			case 'R': {
 					uint8_t numChunks = atoi(optarg);
 					cout << "Setting test: ResponseTime with " << (int)numChunks << " chunks..." << flush;
 					test = make_unique<Test_ResponseTime>(argv[argc-1],numChunks);
+					testName = "responsetime" + std::to_string(numChunks);
+					test->setWorkerPool(&pool);
+					test->setDistribution(dist);
+					test->setMmapOptions(mmapOpts);
+					test->setTrace(traceOut.isOpen() ? &traceOut : nullptr);
+					test->setCompactLocs(compactLocs);
 					test->generateLocs(percent);
+					test->setSampling(sampleMs,sampleOut,sampleJson);
 					cout << "done" << endl;
 				}
 				break;
+			case 'j': {
+					std::vector<JobSpec> jobs;
+					double seconds;
+					std::string err;
+					if(!JobSpec::parseFile(optarg, jobs, seconds, err)) { cerr << "Bad job file: " << err << endl; return 1; }
+					// every job gets its own test and its own workers, so the jobs only meet at the device
+					std::vector<std::unique_ptr<WorkerPool> > pools;
+					std::vector<std::unique_ptr<Test> > tests;
+					for(auto &job : jobs) {
+						pools.push_back(make_unique<WorkerPool>());
+						if(!job.cpus.empty()) {
+							std::vector<int> cpus;
+							WorkerPool::parseCpuList(job.cpus.c_str(), cpus);
+							if(!pools.back()->setCpus(cpus)) cerr << "Warning: could not pin every worker of job " << job.name << " to " << job.cpus << endl;
+						}
+						if(job.test == "responsetime") tests.push_back(make_unique<Test_ResponseTime>(argv[argc-1], job.chunks));
+						else tests.push_back(make_unique<Test_Throughput>(argv[argc-1]));
+						Test &jobTest = *tests.back();
+						jobTest.setWorkerPool(pools.back().get());
+						jobTest.setDistribution(job.dist);
+						jobTest.setMmapOptions(job.mmapOpts);
+						jobTest.setCompactLocs(job.compact);
+						uint64_t devSize = jobTest.getSize();
+						jobTest.setRegion(job.regionStartBytes(devSize), job.regionLengthBytes(devSize));
+						if(jobTest.getSize() < CHUNK_SIZE * 256) { cerr << "Region of job " << job.name << " is too small: " << job.region << endl; return 1; }
+						jobTest.generateLocs(job.percent);
+					}
+					cout << "Running " << jobs.size() << " jobs for " << seconds << " seconds..." << flush;
+					auto endTime = std::chrono::steady_clock::now() + std::chrono::milliseconds((uint64_t) (seconds * 1000));
+					for(unsigned i = 0; i < jobs.size(); i++) tests[i]->start(endTime, jobs[i].workload(), jobs[i].threads, jobs[i].type, jobs[i].queueDepth);
+					cout << "done" << endl;
+					for(unsigned i = 0; i < jobs.size(); i++) {
+						cout << "job " << jobs[i].name << ":" << tests[i]->collect(jobs[i].workload()) << endl;
+						JsonValue phase = tests[i]->getLastResult();
+						phase["config"] = jobs[i].config();
+						phase["config"]["seconds"] = seconds;
+						pushPhase(phase, std::to_string(results["phases"].size() + 1) + ":job:" + jobs[i].name);
+					}
+
+					// all jobs together: what the device delivered in total and the latency every op saw
+					JsonValue phase = JsonValue::object();
+					JsonValue &metrics = phase["metrics"];
+					metrics = JsonValue::object();
+					cout << "all jobs:";
+					for(int op = 1; op >= 0; op--) {
+						const char *opName = op ? "read" : "write";
+						LatencyHistogram merged;
+						double total = 0;
+						for(auto &iter : tests) {
+							iter->mergeLastLatency(op, merged);
+							double secs = std::max(iter->getLastSecs(), 0.001);
+							total += toMB(iter->getLastBytes(op)) / secs;
+						}
+						if(merged.count() == 0) continue;
+						cout << endl << "  " << opName << ": " << total << "MB/s " << merged.count() / seconds << "IOPS";
+						cout << endl << "  " << opName << " latency: " << merged.summary();
+						// no samples: the jobs' throughputs are not draws of one quantity, each job's phase has its own
+						metrics[std::string(opName) + "_throughput_MBps"] = makeMetric(total, "MB/s", true);
+						metrics[std::string(opName) + "_latency_p50_us"] = makeMetric(merged.percentile(50) / 1000.0, "us", false);
+						metrics[std::string(opName) + "_latency_p99_us"] = makeMetric(merged.percentile(99) / 1000.0, "us", false);
+						metrics[std::string(opName) + "_latency_p99.9_us"] = makeMetric(merged.percentile(99.9) / 1000.0, "us", false);
+						metrics[std::string(opName) + "_latency_max_us"] = makeMetric(merged.max() / 1000.0, "us", false);
+						metrics[std::string(opName) + "_ops"] = makeMetric((double) merged.count(), "ops", true);
+					}
+					cout << endl;
+					phase["config"] = JsonValue::object();
+					phase["config"]["job_file"] = optarg;
+					phase["config"]["jobs"] = (double) jobs.size();
+					phase["config"]["seconds"] = seconds;
+					phase["errors"] = JsonValue::array();
+					pushPhase(phase, std::to_string(results["phases"].size() + 1) + ":jobs:all");
+				}
+				break;
+			case OPT_JSON: case OPT_BASELINE: case OPT_TOLERANCE: resultsOpts.parse(opt, optarg); break;
+			case OPT_CPUS: {
+					std::vector<int> cpus;
+					if(!WorkerPool::parseCpuList(optarg, cpus)) { cerr << "Expected a CPU list such as 0-3,8: " << optarg << endl; return 1; }
+					if(!pool.setCpus(cpus)) cerr << "Warning: could not pin every worker to " << optarg << endl;
+					cpuList = optarg;
+				}
+				break;
+			case OPT_HUGEPAGES: BufferArena::setHugePages(true); results["config"]["hugepages"] = true; break;
+			case OPT_MMAP_OPTS:
+				if(!MmapOptions::parse(optarg, mmapOpts)) { cerr << "Expected mmap options such as populate,random: " << optarg << endl; return 1; }
+				test->setMmapOptions(mmapOpts);
+				break;
+			case OPT_MLOCK: BufferArena::setLocked(true); results["config"]["mlock"] = true; break;
+			case OPT_TRACE:
+				if(!traceOut.open(optarg, test->getSize())) { cerr << "Can't create trace file " << optarg << ": " << strerror(errno) << endl; return 1; }
+				test->setTrace(&traceOut);
+				results["config"]["trace"] = optarg;
+				break;
+			case OPT_REPLAY_SPEED:
+				replaySpeed = atof(optarg);
+				if(replaySpeed < 0) { cerr << "Replay speed can't be negative: " << optarg << endl; return 1; }
+				break;
+			case OPT_REPLAY: {
+					Test_Replay replay(argv[argc-1], replaySpeed);
+					std::string err;
+					if(!replay.open(optarg, err)) { cerr << "Can't read trace " << optarg << ": " << err << endl; return 1; }
+					replay.setWorkerPool(&pool);
+					replay.setMmapOptions(mmapOpts);
+					replay.setSampling(sampleMs,sampleOut,sampleJson);
+					cout << "Replay " << optarg << " on " << (int)numThreads << " threads at ";
+					if(replaySpeed > 0) cout << replaySpeed << "x speed..." << flush;
+					else cout << "full speed..." << flush;
+					cout << "done: " << replay.do_testAsString(std::chrono::steady_clock::time_point::max(), replay.workload(), numThreads, type, queueDepth) << endl;
+					JsonValue extra = JsonValue::object();
+					extra["trace"] = optarg;
+					extra["replay_speed"] = replaySpeed;
+					recordPhase("replay", 0, replay, "replay", extra);
+				}
+				break;
 			default: usage(argv[0]); break;
 		}
 	}
@@ -145,6 +483,9 @@ int main( int argc, char* argv[] ) {
 		return 1;
 	}
 
+	if(traceOut.isOpen() && !traceOut.close()) { cerr << "Error writing the trace" << endl; return 1; }
+	if(int rc = resultsOpts.finish(results, 0)) return rc;
+
 	cout << "Test completed successfully" << endl;
 	return 0;
 }
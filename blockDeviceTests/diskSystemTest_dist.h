@@ -0,0 +1,173 @@
+/* Test program created by: Fekete, Andras
+	 Copyright 2016
+	 This program writes a set of random byte sequences in random locations on
+	 the nbd disk and then reads them back to make sure they're correctly written.
+
+	 This program is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 This program is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKSYSTEMTEST_DIST_H
+#define DISKSYSTEMTEST_DIST_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+// Which location a worker touches next. Locations are numbered in offset order
+// (except in compact mode, where the numbering is already a permutation).
+class AccessDist {
+public:
+	enum Kind_t { UNIFORM, ZIPF, HOTCOLD, SEQ, STRIDE, STREAMS };
+	Kind_t kind = UNIFORM;
+	double theta = 0.99;     // ZIPF skew
+	double hotPct = 20;      // HOTCOLD: this percent of the locations...
+	double hotAccessPct = 80; // ...gets this percent of the accesses
+	uint64_t stride = 1;     // STRIDE step in locations
+	unsigned streams = 1;    // STREAMS per worker
+
+	// "uniform", "zipf[:theta]", "hotcold[:hotPct[:accessPct]]", "seq", "stride:<n>", "streams:<n>"
+	static bool parse(const std::string &spec, AccessDist &out) {
+		AccessDist dist;
+		std::vector<std::string> parts;
+		size_t start = 0, pos;
+		while((pos = spec.find(':', start)) != std::string::npos) { parts.push_back(spec.substr(start, pos - start)); start = pos + 1; }
+		parts.push_back(spec.substr(start));
+		const std::string &name = parts[0];
+		if(name == "uniform" && parts.size() == 1) dist.kind = UNIFORM;
+		else if(name == "zipf" && parts.size() <= 2) {
+			dist.kind = ZIPF;
+			if(parts.size() == 2) dist.theta = atof(parts[1].c_str());
+			if(dist.theta <= 0) return false;
+		} else if(name == "hotcold" && parts.size() <= 3) {
+			dist.kind = HOTCOLD;
+			if(parts.size() >= 2) dist.hotPct = atof(parts[1].c_str());
+			if(parts.size() == 3) dist.hotAccessPct = atof(parts[2].c_str());
+			if(dist.hotPct <= 0 || dist.hotPct >= 100 || dist.hotAccessPct < 0 || dist.hotAccessPct > 100) return false;
+		} else if(name == "seq" && parts.size() == 1) dist.kind = SEQ;
+		else if(name == "stride" && parts.size() == 2) {
+			dist.kind = STRIDE;
+			dist.stride = strtoull(parts[1].c_str(), nullptr, 10);
+			if(dist.stride == 0) return false;
+		} else if(name == "streams" && parts.size() == 2) {
+			dist.kind = STREAMS;
+			dist.streams = atoi(parts[1].c_str());
+			if(dist.streams == 0) return false;
+		} else return false;
+		dist.spec = spec;
+		out = dist;
+		return true;
+	}
+	const std::string &getSpec() const { return spec; }
+	bool isSequential() const { return kind == SEQ || kind == STRIDE || kind == STREAMS; }
+
+private:
+	std::string spec = "uniform";
+};
+
+// Per-worker sampler for an AccessDist over 'numLocs' locations. Set-up is O(1)
+// (O(streams) for STREAMS) and next() is O(1) and allocation free.
+class AccessPicker {
+public:
+	AccessPicker(const AccessDist &dist, uint64_t numLocs, std::ranlux48_base &rngGen) : dist(dist), numLocs(numLocs) {
+		switch(dist.kind) {
+			case AccessDist::ZIPF: initZipf(); break;
+			case AccessDist::HOTCOLD:
+				numHot = std::max<uint64_t>(1, numLocs * dist.hotPct / 100);
+				initScramble();
+				break;
+			case AccessDist::STREAMS:
+				positions.resize(dist.streams);
+				for(auto &iter : positions) iter = rngGen() % numLocs;
+				break;
+			default: break;
+		}
+		pos = rngGen() % numLocs; // workers start at different places
+	}
+
+	inline uint64_t next(std::ranlux48_base &rngGen) {
+		switch(dist.kind) {
+			case AccessDist::UNIFORM: return rngGen() % numLocs;
+			case AccessDist::ZIPF: return scramble(sampleZipf(rngGen) - 1);
+			case AccessDist::HOTCOLD:
+				if(uniform(rngGen) * 100 < dist.hotAccessPct || numHot == numLocs) return scramble(rngGen() % numHot);
+				return scramble(numHot + rngGen() % (numLocs - numHot));
+			case AccessDist::SEQ: { uint64_t res = pos; if(++pos == numLocs) pos = 0; return res; }
+			case AccessDist::STRIDE: { uint64_t res = pos; pos = (pos + dist.stride) % numLocs; return res; }
+			case AccessDist::STREAMS: {
+				uint64_t &streamPos = positions[nextStream];
+				if(++nextStream == positions.size()) nextStream = 0;
+				uint64_t res = streamPos;
+				if(++streamPos == numLocs) streamPos = 0;
+				return res;
+			}
+		}
+		return 0;
+	}
+
+private:
+	const AccessDist &dist;
+	uint64_t numLocs;
+	uint64_t pos = 0;
+	std::vector<uint64_t> positions;
+	unsigned nextStream = 0;
+	uint64_t numHot = 0;
+	uint64_t multiplier = 1;
+	double hIntegralX1, hIntegralN, s;
+
+	static inline double uniform(std::ranlux48_base &rngGen) { return (rngGen() - std::ranlux48_base::min()) / ((double) std::ranlux48_base::max() - std::ranlux48_base::min() + 1); }
+
+	// Spreads the popular ranks over the device: rank r -> r*multiplier mod numLocs, a bijection
+	// because the multiplier is coprime to numLocs
+	void initScramble() {
+		multiplier = (uint64_t)(numLocs * 0.6180339887498949) | 1;
+		while(std::gcd(multiplier, numLocs) != 1) multiplier += 2;
+		multiplier %= numLocs;
+		if(multiplier == 0) multiplier = 1;
+	}
+	inline uint64_t scramble(uint64_t rank) const { return (uint64_t)(((unsigned __int128) rank * multiplier) % numLocs); }
+
+	// Zipf by rejection-inversion (Hoermann & Derflinger 1996): O(1) set-up and an
+	// expected < 1.1 iterations per sample for any theta, no table of size numLocs
+	void initZipf() {
+		initScramble();
+		hIntegralX1 = hIntegral(1.5) - 1;
+		hIntegralN = hIntegral(numLocs + 0.5);
+		s = 2 - hIntegralInverse(hIntegral(2.5) - h(2));
+	}
+	inline uint64_t sampleZipf(std::ranlux48_base &rngGen) const {
+		while(true) {
+			double u = hIntegralN + uniform(rngGen) * (hIntegralX1 - hIntegralN);
+			double x = hIntegralInverse(u);
+			uint64_t k = (uint64_t)(x + 0.5);
+			if(k < 1) k = 1;
+			else if(k > numLocs) k = numLocs;
+			if(k - x <= s || u >= hIntegral(k + 0.5) - h(k)) return k;
+		}
+	}
+	inline double h(double x) const { return exp(-dist.theta * log(x)); }
+	inline double hIntegral(double x) const { double logX = log(x); return helper2((1 - dist.theta) * logX) * logX; }
+	inline double hIntegralInverse(double x) const {
+		double t = x * (1 - dist.theta);
+		if(t < -1) t = -1; // numerical safety near the upper end
+		return exp(helper1(t) * x);
+	}
+	static inline double helper1(double x) { return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x)); }
+	static inline double helper2(double x) { return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x)); }
+};
+
+#endif
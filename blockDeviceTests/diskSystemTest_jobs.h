@@ -0,0 +1,200 @@
+/* Test program created by: Fekete, Andras
+	 Copyright 2016
+	 This program writes a set of random byte sequences in random locations on
+	 the nbd disk and then reads them back to make sure they're correctly written.
+
+	 This program is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 This program is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKSYSTEMTEST_JOBS_H
+#define DISKSYSTEMTEST_JOBS_H
+
+#include <stdlib.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include "../WorkerPool.h"
+#include "diskSystemTest_tests.h"
+
+// One job of a job file: a test with its own settings that runs alongside the others.
+struct JobSpec {
+	std::string name;
+	std::string test = "throughput";  // or "responsetime"
+	uint8_t chunks = 1;                // location size of a responsetime job
+	Test::File_t type = Test::FILE_UNBUFFERED;
+	std::string mode = "unbuffered";
+	unsigned queueDepth = 32;
+	uint8_t threads = 1;
+	double readPct = 100;
+	uint8_t readChunks = 0, writeChunks = 0;
+	AccessDist dist;
+	double iops = 0;
+	bool poisson = false;
+	double percent = 1.0;             // of the region
+	bool compact = false;
+	MmapOptions mmapOpts;
+	std::string cpus;
+	std::string region = "0:100%";
+	double regionStart = 0, regionLength = 100; // bytes, or percent of the device when the flag is set
+	bool startPct = false, lengthPct = true;
+
+	Workload workload() const {
+		Workload work(readPct, readChunks, writeChunks);
+		work.targetIops = iops;
+		work.poisson = poisson;
+		return work;
+	}
+	// Both are rounded down to whole chunks, so direct I/O stays aligned and regions that meet at
+	// the same percentage still don't overlap
+	uint64_t regionStartBytes(uint64_t devSize) const { return toChunk(startPct ? devSize * regionStart / 100 : regionStart); }
+	uint64_t regionLengthBytes(uint64_t devSize) const { return toChunk(lengthPct ? devSize * regionLength / 100 : regionLength); }
+
+	JsonValue config() const {
+		JsonValue res = JsonValue::object();
+		res["test"] = test;
+		if(test == "responsetime") res["chunks"] = chunks;
+		res["access_mode"] = mode;
+		res["threads"] = threads;
+		res["queue_depth"] = queueDepth;
+		res["read_pct"] = readPct;
+		if(readChunks) res["read_kb"] = readChunks * CHUNK_SIZE / 1024;
+		if(writeChunks) res["write_kb"] = writeChunks * CHUNK_SIZE / 1024;
+		res["distribution"] = dist.getSpec();
+		if(iops > 0) {
+			res["target_iops"] = iops;
+			res["arrivals"] = poisson ? "poisson" : "fixed";
+		}
+		res["region"] = region;
+		res["percent"] = percent;
+		res["compact_locations"] = compact;
+		if(type == Test::FILE_MMAP) res["mmap_options"] = mmapOpts.spec;
+		if(!cpus.empty()) res["cpus"] = cpus;
+		return res;
+	}
+
+	// Job file: "key=value" lines. Lines before the first "[name]" set the run
+	// time (minutes=, seconds=); each "[name]" starts a job and the lines after
+	// it set that job's keys. '#' starts a comment.
+	static bool parseFile(const std::string &path, std::vector<JobSpec> &jobs, double &seconds, std::string &err) {
+		std::ifstream in(path);
+		if(!in.is_open()) { err = "can't open " + path; return false; }
+		jobs.clear();
+		seconds = 0;
+		bool timeSet = false;
+		std::string line;
+		for(unsigned lineNum = 1; std::getline(in, line); lineNum++) {
+			size_t hash = line.find('#');
+			if(hash != std::string::npos) line.erase(hash);
+			line = trim(line);
+			if(line.empty()) continue;
+			std::ostringstream where;
+			where << path << ':' << lineNum << ": ";
+			if(line[0] == '[') {
+				if(line.back() != ']' || line.size() < 3) { err = where.str() + "expected [name]"; return false; }
+				jobs.push_back(JobSpec());
+				jobs.back().name = trim(line.substr(1, line.size() - 2));
+				continue;
+			}
+			size_t eq = line.find('=');
+			if(eq == std::string::npos) { err = where.str() + "expected key=value"; return false; }
+			std::string key = trim(line.substr(0, eq)), val = trim(line.substr(eq + 1));
+			if(jobs.empty()) {
+				char *end;
+				double num = strtod(val.c_str(), &end);
+				if(*end || end == val.c_str() || num < 0 || (key != "minutes" && key != "seconds")) { err = where.str() + "expected minutes=<n> or seconds=<n> before the first job"; return false; }
+				seconds += (key == "minutes") ? num * 60 : num;
+				timeSet = true;
+			} else if(!jobs.back().set(key, val)) { err = where.str() + "bad value for '" + key + "': " + val; return false; }
+		}
+		if(jobs.empty()) { err = path + ": no jobs"; return false; }
+		if(!timeSet) seconds = 60;
+		return true;
+	}
+
+private:
+	static uint64_t toChunk(double bytes) { return (uint64_t) bytes / CHUNK_SIZE * CHUNK_SIZE; }
+	static std::string trim(const std::string &str) {
+		size_t first = str.find_first_not_of(" \t\r");
+		if(first == std::string::npos) return "";
+		return str.substr(first, str.find_last_not_of(" \t\r") - first + 1);
+	}
+	static bool toNumber(const std::string &val, double &out, double min, double max) {
+		char *end;
+		out = strtod(val.c_str(), &end);
+		return end != val.c_str() && *end == '\0' && out >= min && out <= max;
+	}
+	// A byte count with an optional K/M/G/T suffix (powers of 1024), or a percentage
+	static bool toExtent(const std::string &val, double &out, bool &isPct) {
+		char *end;
+		out = strtod(val.c_str(), &end);
+		if(end == val.c_str() || out < 0) return false;
+		std::string unit = end;
+		isPct = unit == "%";
+		if(isPct) return out <= 100;
+		if(!unit.empty() && (unit.back() == 'B' || unit.back() == 'b')) unit.pop_back();
+		if(unit.empty()) return true;
+		if(unit.size() != 1) return false;
+		const char *suffixes = "KMGT";
+		const char *pos = strchr(suffixes, toupper(unit[0]));
+		if(pos == nullptr) return false;
+		for(const char *i = suffixes; i <= pos; i++) out *= 1024;
+		return true;
+	}
+
+	bool set(const std::string &key, const std::string &val) {
+		double num;
+		if(key == "test") { test = val; return test == "throughput" || test == "responsetime"; }
+		if(key == "chunks") { if(!toNumber(val, num, 1, 255)) return false; chunks = num; return true; }
+		if(key == "mode") {
+			mode = val;
+			if(val == "direct") type = Test::FILE_DIRECT;
+			else if(val == "buffered") type = Test::FILE_BUFFERED;
+			else if(val == "unbuffered") type = Test::FILE_UNBUFFERED;
+			else if(val == "io_uring") type = Test::FILE_IOURING;
+			else if(val == "mmap") type = Test::FILE_MMAP;
+			else return false;
+			return true;
+		}
+		if(key == "qd") { if(!toNumber(val, num, 1, 65536)) return false; queueDepth = num; return true; }
+		if(key == "threads") { if(!toNumber(val, num, 1, 255)) return false; threads = num; return true; }
+		if(key == "read") return toNumber(val, readPct, 0, 100);
+		if(key == "readkb" || key == "writekb") {
+			// whole chunks only, like -M; 0 keeps the location size
+			if(!toNumber(val, num, 0, 255 * CHUNK_SIZE / 1024) || fmod(num, CHUNK_SIZE / 1024) != 0) return false;
+			(key == "readkb" ? readChunks : writeChunks) = (uint8_t) (num * 1024 / CHUNK_SIZE);
+			return true;
+		}
+		if(key == "dist") return AccessDist::parse(val, dist);
+		if(key == "iops") return toNumber(val, iops, 0, 1e12);
+		if(key == "arrivals") { poisson = val == "poisson"; return poisson || val == "fixed"; }
+		if(key == "percent") return toNumber(val, percent, 0, 100);
+		if(key == "compact") {
+			compact = val == "1" || val == "yes" || val == "true";
+			return compact || val == "0" || val == "no" || val == "false";
+		}
+		if(key == "mmap") return MmapOptions::parse(val, mmapOpts);
+		if(key == "cpus") { std::vector<int> list; cpus = val; return WorkerPool::parseCpuList(val.c_str(), list); }
+		if(key == "region") {
+			// <start>:<length>, each a size or a percent of the device
+			size_t colon = val.find(':');
+			if(colon == std::string::npos) return false;
+			region = val;
+			return toExtent(val.substr(0, colon), regionStart, startPct) && toExtent(val.substr(colon + 1), regionLength, lengthPct);
+		}
+		return false;
+	}
+};
+
+#endif
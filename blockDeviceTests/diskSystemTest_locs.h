@@ -0,0 +1,201 @@
+/* Test program created by: Fekete, Andras
+	 Copyright 2016
+	 This program writes a set of random byte sequences in random locations on
+	 the nbd disk and then reads them back to make sure they're correctly written.
+
+	 This program is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 This program is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKSYSTEMTEST_LOCS_H
+#define DISKSYSTEMTEST_LOCS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include "../Pattern.h"
+
+#define CHUNK_SIZE 4096
+
+class TXLocs_t {
+	public:
+		off64_t offset;
+		uint8_t numChunks; // 8bits * CHUNK_SIZE makes max TX size 1MB
+		bool operator<(const TXLocs_t& rhs) const { return this->offset < rhs.offset; }
+};
+
+// Allocates disjoint extents in linear time. The file is cut into equal slots
+// of 'slotChunks' chunks and every extent lives inside its own slot, so extents
+// can never collide. Slots are picked with sequential sampling (Vitter's
+// Algorithm A): one pass over the slots in order and one random draw per pick,
+// which produces a sorted result, needs no memory beyond the output and
+// reaches any utilization up to 100% without retries. The same seed always gives the same extents.
+class SlotAllocator {
+public:
+	// 'fixedSize' makes every extent a whole slot, otherwise extents are 1..slotChunks chunks long
+	SlotAllocator(uint64_t fileSize, uint8_t maxChunks, bool fixedSize) : fixedSize(fixedSize) {
+		uint64_t fileChunks = fileSize / CHUNK_SIZE;
+		slotChunks = (uint8_t) std::max<uint64_t>(1, std::min<uint64_t>(maxChunks, fileChunks));
+		numSlots = fileChunks / slotChunks;
+	}
+
+	uint64_t getNumSlots() const { return numSlots; }
+	uint64_t getNumCompact() const { return numCompact; }
+	uint8_t getSlotChunks() const { return slotChunks; }
+
+	void generate(std::vector<TXLocs_t> &out, double percentUtil, uint64_t seed) {
+		std::ranlux48_base rngGen(seed);
+		uint64_t numPicks = setLengths(numSlots * slotChunks * percentUtil / 100);
+		out.clear();
+		out.reserve(numPicks);
+		uint64_t slot = 0;
+		for(uint64_t picked = 0; picked < numPicks; picked++) {
+			slot += skip(numSlots - slot, numPicks - picked, rngGen);
+			out.push_back(extentIn(slot++, rngGen));
+		}
+	}
+
+	// Replaces about 'percentChange'% of 'locs' with new extents in slots that are not in use
+	void update(std::vector<TXLocs_t> &locs, double percentChange, uint64_t seed) {
+		std::ranlux48_base rngGen(seed);
+		std::vector<uint64_t> used((numSlots + 63) / 64, 0);
+		std::vector<TXLocs_t> kept;
+		kept.reserve(locs.size());
+		for(auto &iter : locs) {
+			if(uniform(rngGen) * 100 < percentChange) continue;
+			uint64_t slot = iter.offset / ((uint64_t) slotChunks * CHUNK_SIZE);
+			used[slot / 64] |= 1ULL << (slot % 64);
+			kept.push_back(iter);
+		}
+		uint64_t numPicks = locs.size() - kept.size();
+		uint64_t numFree = numSlots - kept.size();
+		std::vector<TXLocs_t> added;
+		added.reserve(numPicks);
+		uint64_t slot = 0;
+		while(added.size() < numPicks) {
+			uint64_t toSkip = skip(numFree, numPicks - added.size(), rngGen);
+			numFree -= toSkip + 1;
+			// walk to the (toSkip+1)th free slot, a bitmap word at a time
+			while(true) {
+				uint64_t freeBits = ~used[slot / 64] >> (slot % 64);
+				unsigned inWord = std::min<uint64_t>(64 - slot % 64, numSlots - slot);
+				if(inWord < 64) freeBits &= (1ULL << inWord) - 1;
+				unsigned numInWord = __builtin_popcountll(freeBits);
+				if(toSkip < numInWord) {
+					for(; toSkip; toSkip--) freeBits &= freeBits - 1;
+					slot += __builtin_ctzll(freeBits);
+					break;
+				}
+				toSkip -= numInWord;
+				slot += inWord;
+			}
+			added.push_back(extentIn(slot++, rngGen));
+		}
+		locs.clear();
+		std::merge(kept.begin(), kept.end(), added.begin(), added.end(), std::back_inserter(locs));
+	}
+
+	// Compact mode: nothing is stored, location 'idx' is computed by locate(). The
+	// working set is the first getNumCompact() slots of a keyed permutation of all
+	// slots; a location moved by 'm' updates uses the permuted slot m*getNumCompact()
+	// further on, which keeps all locations disjoint without remembering any of them.
+	void generateCompact(double percentUtil, uint64_t seed) {
+		numCompact = setLengths(numSlots * slotChunks * percentUtil / 100);
+		key = PatternGen::mix(seed);
+		for(unsigned i = 0; i < FEISTEL_ROUNDS; i++) roundKeys[i] = PatternGen::mix(key + i + 1);
+		halfBits = 1;
+		while((1ULL << (2 * halfBits)) < numSlots) halfBits++;
+		epochs.clear();
+	}
+
+	// Each update is one more epoch that moves about 'percentChange'% of the locations.
+	// locate() costs one hash per epoch, so this suits a handful of -P steps per run.
+	void updateCompact(double percentChange, uint64_t seed) { epochs.push_back({ PatternGen::mix(key ^ seed), percentChange }); }
+
+	inline TXLocs_t locate(uint64_t idx) const {
+		uint64_t moves = 0;
+		for(auto &iter : epochs) if((PatternGen::mix(iter.key ^ idx) >> 11) * (100.0 / 9007199254740992.0) < iter.percent) moves++;
+		// generateCompact() left numCompact between 1 and numSlots when there is anything to locate
+		uint64_t slot = permute(idx + (moves % (numSlots / numCompact)) * numCompact);
+		uint64_t r = PatternGen::mix(key ^ PatternGen::mix(slot) ^ moves);
+		TXLocs_t loc;
+		loc.numChunks = (minLen == slotChunks) ? slotChunks : minLen + r % (slotChunks - minLen + 1);
+		uint64_t start = (loc.numChunks == slotChunks) ? 0 : (r >> 32) % (slotChunks - loc.numChunks + 1);
+		loc.offset = (slot * slotChunks + start) * CHUNK_SIZE;
+		return loc;
+	}
+
+private:
+	static const unsigned FEISTEL_ROUNDS = 4;
+
+	// Bijection on [0,numSlots): a balanced Feistel network over the next even power
+	// of two, cycle-walked until the result falls inside the range (< 4 steps on average)
+	inline uint64_t permute(uint64_t x) const {
+		uint64_t mask = (1ULL << halfBits) - 1;
+		do {
+			uint64_t l = x >> halfBits, r = x & mask;
+			for(unsigned i = 0; i < FEISTEL_ROUNDS; i++) { uint64_t t = l ^ (PatternGen::mix(r ^ roundKeys[i]) & mask); l = r; r = t; }
+			x = (l << halfBits) | r;
+		} while(x >= numSlots);
+		return x;
+	}
+
+	static double uniform(std::ranlux48_base &rngGen) { return (rngGen() - std::ranlux48_base::min()) / ((double) std::ranlux48_base::max() - std::ranlux48_base::min() + 1); }
+
+	// Number of candidates to pass over before the next pick when 'needed' of 'remaining' are still to be picked
+	static uint64_t skip(uint64_t remaining, uint64_t needed, std::ranlux48_base &rngGen) {
+		double v = uniform(rngGen);
+		double top = remaining - needed, total = remaining;
+		double quot = top / total;
+		uint64_t s = 0;
+		while(quot > v) { s++; top--; total--; quot *= top / total; }
+		return s;
+	}
+
+	// Picks how many slots to use and the extent length range so that the extents add up to 'desiredChunks'
+	uint64_t setLengths(uint64_t desiredChunks) {
+		if(numSlots == 0) return 0;
+		if(fixedSize) { minLen = slotChunks; return std::min(numSlots, std::max<uint64_t>(1, (desiredChunks + slotChunks - 1) / slotChunks)); }
+		minLen = 1;
+		double meanLen = (1 + slotChunks) / 2.0;
+		uint64_t numPicks = std::max<uint64_t>(1, (uint64_t)(desiredChunks / meanLen + 0.5));
+		if(numPicks <= numSlots) return numPicks;
+		// more than half full: every slot is used and extents get longer to make up the difference
+		double lo = 2.0 * desiredChunks / numSlots - slotChunks;
+		minLen = (uint8_t) std::max(1.0, std::min((double) slotChunks, lo + 0.5));
+		return numSlots;
+	}
+
+	TXLocs_t extentIn(uint64_t slot, std::ranlux48_base &rngGen) {
+		TXLocs_t loc;
+		loc.numChunks = (minLen == slotChunks) ? slotChunks : minLen + rngGen() % (slotChunks - minLen + 1);
+		uint64_t start = (loc.numChunks == slotChunks) ? 0 : rngGen() % (slotChunks - loc.numChunks + 1);
+		loc.offset = (slot * slotChunks + start) * CHUNK_SIZE;
+		return loc;
+	}
+
+	bool fixedSize;
+	uint8_t slotChunks;
+	uint8_t minLen = 1;
+	uint64_t numSlots;
+
+	struct Epoch { uint64_t key; double percent; };
+	uint64_t numCompact = 0;
+	uint64_t key = 0;
+	uint64_t roundKeys[FEISTEL_ROUNDS];
+	unsigned halfBits = 1;
+	std::vector<Epoch> epochs;
+};
+
+#endif
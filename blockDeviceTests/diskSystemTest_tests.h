@@ -16,6 +16,9 @@
 	 You should have received a copy of the GNU General Public License
 	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef DISKSYSTEMTEST_TESTS_H
+#define DISKSYSTEMTEST_TESTS_H
+
 #include <assert.h>
 #include <iostream>
 #include <sstream>
@@ -26,90 +29,203 @@
 #include <string.h>
 #include <memory>
 #include <chrono>
-#include <future>
-#include <set>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <math.h>
 #include "../File.h"
+#include "../Histogram.h"
+#include "../Results.h"
+#include "../WorkerPool.h"
+#include "diskSystemTest_locs.h"
+#include "diskSystemTest_dist.h"
+#include "diskSystemTest_trace.h"
 using namespace std;
 
-#define CHUNK_SIZE 4096
+// State owned by one worker thread for the duration of a phase. Only the
+// owner writes; the sampler thread reads the counters while the phase runs.
+struct WorkerStats {
+	LatencyHistogram latency[2]; // indexed by isRead
+	std::atomic<uint64_t> bytes[2] = { {0}, {0} };
+	inline void addBytes(bool isRead, uint64_t len) { bytes[isRead].store(bytes[isRead].load(std::memory_order_relaxed) + len, std::memory_order_relaxed); }
+	// Open-loop phases only, read after the phase: ops sent, ops sent over one interval after their intended time, and the worst lag
+	uint64_t pacedOps = 0;
+	uint64_t lateOps = 0;
+	uint64_t maxLagNs = 0;
+	inline void addLag(uint64_t lagNs, uint64_t lateNs) { pacedOps++; if(lagNs > lateNs) lateOps++; if(lagNs > maxLagNs) maxLagNs = lagNs; }
+	TraceWriter::Stream *trace = nullptr; // where to record this worker's ops, if anywhere
+};
+
+// What the workers of a phase do: every op is a read with probability readPct%.
+// readChunks/writeChunks cap the size of each op type (0 = the whole location).
+struct Workload {
+	double readPct;
+	uint8_t readChunks = 0;
+	uint8_t writeChunks = 0;
+	double targetIops = 0; // open loop: send at this total rate, measuring latency from the intended send time (0 = closed loop)
+	bool poisson = false;  // exponential instead of fixed gaps between sends
+	Workload(bool isRead) : readPct(isRead ? 100 : 0) { } // a bool still selects a pure read or write phase
+	Workload(double readPct, uint8_t readChunks, uint8_t writeChunks) : readPct(readPct), readChunks(readChunks), writeChunks(writeChunks) { }
+	bool isMixed() const { return readPct > 0 && readPct < 100; }
+	const char *name() const { return isMixed() ? "mixed" : (readPct >= 100 ? "read" : "write"); }
+	inline bool nextIsRead(std::ranlux48_base &rngGen) const {
+		if(!isMixed()) return readPct >= 100;
+		return (rngGen() % 10000) < readPct * 100;
+	}
+	// Length of an op of the given type at a location of 'numChunks' chunks
+	inline ssize_t opLen(bool isRead, uint8_t numChunks) const {
+		uint8_t cap = isRead ? readChunks : writeChunks;
+		return (ssize_t) ((cap && cap < numChunks) ? cap : numChunks) * CHUNK_SIZE;
+	}
+};
 
-struct voidPtrDeleter { void operator()(void *p) { free(p); } };
+// Intended send times of one open-loop worker. The schedule depends only on the
+// rate and seed, never on how fast the device answers, so a stall shows up as
+// queueing delay instead of as fewer requests (no coordinated omission).
+class Pacer {
+public:
+	Pacer(double ratePerSec, bool poisson, std::chrono::steady_clock::time_point start, uint64_t seed) :
+		intervalNs(1e9 / ratePerSec), poisson(poisson), rngGen(seed), nextTime(start) { advance(); }
+	inline std::chrono::steady_clock::time_point peek() const { return nextTime; }
+	inline std::chrono::steady_clock::time_point next() { auto res = nextTime; advance(); return res; }
+	uint64_t getIntervalNs() const { return intervalNs; }
+	// Sleeps for most of the gap and spins the rest, as sleeps overshoot by tens of microseconds
+	static void waitUntil(std::chrono::steady_clock::time_point when) {
+		auto now = std::chrono::steady_clock::now();
+		if(when - now > std::chrono::microseconds(200)) std::this_thread::sleep_until(when - std::chrono::microseconds(100));
+		while(std::chrono::steady_clock::now() < when) std::this_thread::yield();
+	}
+private:
+	inline void advance() {
+		double gap = poisson ? -log(1 - (rngGen() - std::ranlux48_base::min()) / ((double) std::ranlux48_base::max() - std::ranlux48_base::min() + 1)) * intervalNs : intervalNs;
+		nextTime += std::chrono::nanoseconds((uint64_t) gap);
+	}
+	uint64_t intervalNs;
+	bool poisson;
+	std::ranlux48_base rngGen;
+	std::chrono::steady_clock::time_point nextTime;
+};
 
 class Test {
 public:
 	Test(const char *fileName) {
-		FileBuffered file(fileName);
-		if(file.getSize() == 0) { cerr << "error opening file" << endl; return; }
+		std::unique_ptr<File> file = openFile<FileBuffered>(fileName);
+		if(file->getSize() == 0) { cerr << "error opening file" << endl; return; }
 		fname = fileName;
-		fSize = file.getSize();
+		fSize = devSize = file->getSize();
+	}
+	virtual ~Test() {}
+	uint64_t getSize() const { return fSize; }
+	// Confine the test to 'length' bytes from 'start' of the device; takes effect at the next generateLocs()
+	virtual void setRegion(uint64_t start, uint64_t length) {
+		regionStart = std::min(start, devSize);
+		fSize = std::min(length, devSize - regionStart);
 	}
-	~Test() {}
 	virtual std::string resultAsString(uint64_t) = 0;
-	typedef enum { FILE_DIRECT, FILE_BUFFERED, FILE_UNBUFFERED } File_t;
-	uint64_t do_test(const std::chrono::steady_clock::time_point endTime, bool isRead, uint8_t numThread, File_t type ) {
-		std::vector<std::future<int64_t>> procs;
-		switch(type) {
-			case FILE_DIRECT:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileDirect myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-			case FILE_BUFFERED:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileBuffered myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-			case FILE_UNBUFFERED:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileUnbuffered myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-		}
-		int64_t curRet;
+	virtual void addResultMetrics(JsonValue &metrics, const std::vector<int64_t> &perThread, uint64_t avg) = 0;
+	typedef enum { FILE_DIRECT, FILE_BUFFERED, FILE_UNBUFFERED, FILE_IOURING, FILE_MMAP } File_t;
+	uint64_t do_test(const std::chrono::steady_clock::time_point endTime, const Workload &work, uint8_t numThread, File_t type, unsigned queueDepth = 1 ) {
+		launch(endTime, work, numThread, type, queueDepth);
+		std::vector<int64_t> procs = finish();
 		uint64_t total = 0;
-		for( auto &iter : procs ) {
-			curRet = iter.get();
+		for( auto curRet : procs ) {
 			if(curRet == -1) return 0;
 			total += curRet;
 		}
 		return total / procs.size();
 	}
-	std::string do_testAsString(const std::chrono::steady_clock::time_point endTime, bool isRead, uint8_t numThread, File_t type ) {
-		std::vector<std::future<int64_t>> procs;
-		switch(type) {
-			case FILE_DIRECT:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileDirect myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-			case FILE_BUFFERED:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileBuffered myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-			case FILE_UNBUFFERED:
-				for(uint8_t i = 0; i < numThread; i++ ) procs.push_back(std::async(std::launch::async,[&]() { FileUnbuffered myFile(fname.c_str()); return do_file(&myFile,endTime,isRead); } ));
-				break;
-		}
-		int64_t curRet;
+	std::string do_testAsString(const std::chrono::steady_clock::time_point endTime, const Workload &work, uint8_t numThread, File_t type, unsigned queueDepth = 1 ) {
+		start(endTime, work, numThread, type, queueDepth);
+		return collect(work);
+	}
+	// do_testAsString() in two halves, so that several tests can run at the same time
+	void start(const std::chrono::steady_clock::time_point endTime, const Workload &work, uint8_t numThread, File_t type, unsigned queueDepth = 1 ) {
+		phaseStart = std::chrono::steady_clock::now();
+		launch(endTime, work, numThread, type, queueDepth);
+	}
+	std::string collect(const Workload &work) {
+		std::vector<int64_t> procs = finish();
 		uint64_t total = 0;
 		std::ostringstream os;
-		for( auto &iter : procs ) {
-			curRet = iter.get();
+		double secs = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - phaseStart).count() / 1000.0;
+		lastSecs = secs;
+		std::vector<int64_t> perThread;
+		for( auto curRet : procs ) {
 			os << ' ' << resultAsString(curRet);
 			if(curRet > 0) total += curRet;
+			perThread.push_back(curRet);
 		}
 		os << ", avg=" << resultAsString(total / procs.size());
+		if(work.targetIops > 0) addScheduleResults(os, work, secs);
+
+		lastResult = JsonValue::object();
+		JsonValue &metrics = lastResult["metrics"];
+		metrics = JsonValue::object();
+		addResultMetrics(metrics, perThread, total / procs.size());
+		if(work.targetIops > 0) addScheduleMetrics(metrics, secs);
+		for(int op = 1; op >= 0; op--) {
+			const char *opName = op ? "read" : "write";
+			LatencyHistogram merged;
+			for( auto &iter : workers ) merged.merge(iter.latency[op]);
+			if(merged.count() == 0) continue;
+			if(work.isMixed()) {
+				std::vector<double> samples;
+				uint64_t bytes = 0;
+				for( auto &iter : workers ) { samples.push_back(iter.bytes[op].load() / secs / (1024*1024)); bytes += iter.bytes[op].load(); }
+				os << std::endl << "  " << opName << ": " << bytes / secs / (1024*1024) << "MB/s " << merged.count() / secs << "IOPS";
+				metrics[std::string(opName) + "_throughput_MBps"] = makeMetric(bytes / secs / (1024*1024), "MB/s", true, samples);
+			}
+			os << std::endl << "  " << opName << " latency: " << merged.summary();
+			addLatencyMetrics(metrics, opName, merged, op);
+		}
+		JsonValue errors = JsonValue::array();
+		for( auto iter : perThread ) if(iter <= 0) errors.push("worker failed");
+		lastResult["errors"] = errors;
 		return os.str();
 	}
+	// Metrics of the last do_testAsString() phase, as a results-file phase without its name
+	const JsonValue &getLastResult() { return lastResult; }
+	// Raw totals of the last phase, for combining several tests
+	double getLastSecs() const { return lastSecs; }
+	uint64_t getLastBytes(bool isRead) const { uint64_t res = 0; for( auto &iter : workers ) res += iter.bytes[isRead].load(); return res; }
+	void mergeLastLatency(bool isRead, LatencyHistogram &into) const { for( auto &iter : workers ) into.merge(iter.latency[isRead]); }
+	// Every 'intervalMs' while a phase runs, write one sample per active op type to 'out'.
+	// 'asJson' selects JSON lines instead of CSV.
+	void setSampling(unsigned intervalMs, std::ostream *out, bool asJson) {
+		sampleMs = intervalMs;
+		sampleOut = out;
+		sampleJson = asJson;
+	}
+	static const char *sampleCsvHeader() { return "phase,op,elapsed_ms,bytes,ops,MBps,IOPS,min_us,p50_us,p90_us,p99_us,p99.9_us,max_us"; }
+	// Run phases on 'newPool' (shared with other tests) instead of a pool of our own
+	void setWorkerPool(WorkerPool *newPool) { pool = newPool; }
+	// Compute locations from a seed on demand instead of storing them; takes effect at the next generateLocs()
+	void setCompactLocs(bool compact) { compactLocs = compact; }
+	// How workers choose the next location in the following phases
+	void setDistribution(const AccessDist &newDist) { dist = newDist; }
+	// Record every op of the following phases to 'newTrace' (nullptr stops recording)
+	void setTrace(TraceWriter *newTrace) { trace = newTrace; }
+	// Mapping options for FILE_MMAP phases; files already mapped are reopened with them
+	void setMmapOptions(const MmapOptions &opts) { mmapOpts = opts; files.clear(); }
 	virtual void generateLocs(double percentUtil) = 0;
 	virtual void updateLocs(double percentChange) = 0;
 	int64_t cacheClear(const std::chrono::steady_clock::time_point endTime) {
-		FileBuffered file(fname.c_str());
-		if(file.getSize() == 0) { cerr << "Can't open file: " << fname << endl; return -1; }
+		std::unique_ptr<File> file = openFile<FileBuffered>(fname.c_str());
+		if(file->getSize() == 0) { cerr << "Can't open file: " << fname << endl; return -1; }
 		const unsigned int maxChunks = 15;
-		void *testMem;
-		if(posix_memalign(&testMem, 4096, maxChunks*CHUNK_SIZE)) { cerr << "Failed aligning memory" << strerror(errno) << endl; return -1; }
-		unique_ptr<void,voidPtrDeleter> testPtr(testMem); // make smart ptr remember to free the memory
+		BufferArena::Slab testMemSlab = BufferArena::local().slab(maxChunks*CHUNK_SIZE);
+		char *testMem = testMemSlab.data();
+		if(testMem == nullptr) { cerr << "Failed allocating buffer" << endl; return -1; }
 
 		std::ranlux48_base rngGen(rand());
 		uint64_t sizeRead = 0;
 		while(std::chrono::steady_clock::now() < endTime) {
-			off64_t offset = rngGen() % file.getSize();
+			off64_t offset = rngGen() % file->getSize();
 			offset -= offset % CHUNK_SIZE; // snap to mem boundary
 			uint8_t numChunks = rngGen() % maxChunks;
 
-			if(file.read((char*)testMem,numChunks*CHUNK_SIZE,offset) != (numChunks*CHUNK_SIZE)) {
+			if(file->read(testMem,numChunks*CHUNK_SIZE,offset) != (numChunks*CHUNK_SIZE)) {
 				cerr << "Error in cache clearing read: " << strerror(errno) << endl;
 				return -1;
 			}
@@ -118,157 +234,500 @@ public:
 
 		return sizeRead;
 	}
+	// Evicts the tested region from the page cache
+	bool evictCache() {
+		std::unique_ptr<File> file = openFile<FileUnbuffered>(fname.c_str());
+		return file->getSize() != 0 && file->dropCache(regionStart, fSize) == 0;
+	}
+	// Percent of the working set's pages resident in the page cache, over locations spread evenly
+	// through it, or drawn from the access distribution ('byAccess'): the hit ratio a phase should see
+	virtual bool cacheResidency(bool byAccess, double &pct) = 0;
+	// Reads locations the way a phase would until 'targetPct' of the accesses would hit the page
+	// cache (or until 'endTime'). Returns the bytes read, -1 on failure; 'pct' is the ratio reached.
+	virtual int64_t warmCache(double targetPct, const std::chrono::steady_clock::time_point endTime, double &pct) = 0;
 protected:
 	std::string fname;
-	uint64_t fSize;
-	virtual int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, bool isRead) = 0;
+	uint64_t fSize = 0;
+	uint64_t devSize = 0;
+	uint64_t regionStart = 0; // fSize bytes from here are the ones the test touches
+	std::chrono::steady_clock::time_point phaseStart;
+	double lastSecs = 0;
+	bool compactLocs = false;
+	MmapOptions mmapOpts;
+	TraceWriter *trace = nullptr;
+	AccessDist dist;
+	virtual int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) = 0;
+	// Keeps up to file->getQueueDepth() requests in flight. Falls back to the synchronous loop by default.
+	virtual int64_t do_fileAsync(FileIoUring *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) { return do_file(file, endTime, work, stats); }
+
+	std::vector<WorkerStats> workers;
+	JsonValue lastResult;
+	unsigned sampleMs = 0;
+	std::ostream *sampleOut = nullptr;
+	bool sampleJson = false;
+	unsigned phaseNum = 0;
+	std::atomic<bool> sampling{false};
+	std::thread sampler;
+
+	WorkerPool *pool = nullptr;
+	std::unique_ptr<WorkerPool> ownPool;
+
+	// A worker's open file, kept from one phase to the next while the access mode stays the same
+	struct OpenFile {
+		std::unique_ptr<File> file;
+		File_t type;
+		unsigned queueDepth;
+	};
+	std::vector<OpenFile> files;
+
+	// Called on worker 'idx' itself, so only that worker ever touches files[idx]
+	File *workerFile(unsigned idx, File_t type, unsigned queueDepth) {
+		OpenFile &cur = files[idx];
+		if(cur.file && cur.type == type && (type != FILE_IOURING || cur.queueDepth == queueDepth)) return cur.file.get();
+		cur.file.reset();
+		switch(type) {
+			case FILE_DIRECT: cur.file = openFile<FileDirect>(fname.c_str()); break;
+			case FILE_BUFFERED: cur.file = openFile<FileBuffered>(fname.c_str()); break;
+			case FILE_UNBUFFERED: cur.file = openFile<FileUnbuffered>(fname.c_str()); break;
+			case FILE_IOURING: cur.file = openFile<FileIoUring>(fname.c_str(), queueDepth); break;
+			case FILE_MMAP: cur.file = openFile<FileMmap>(fname.c_str(), mmapOpts); break;
+		}
+		cur.type = type;
+		cur.queueDepth = queueDepth;
+		return cur.file.get();
+	}
+
+	void launch(const std::chrono::steady_clock::time_point endTime, const Workload &work, uint8_t numThread, File_t type, unsigned queueDepth) {
+		if(pool == nullptr) { ownPool = std::make_unique<WorkerPool>(); pool = ownPool.get(); }
+		workers = std::vector<WorkerStats>(numThread);
+		if(files.size() < numThread) files.resize(numThread);
+		if(trace) {
+			trace->beginPhase(numThread);
+			for(unsigned i = 0; i < numThread; i++) workers[i].trace = &trace->stream(i);
+		}
+		phaseNum++;
+		if(sampleMs) { sampling = true; sampler = std::thread([this]() { sampleLoop(); }); }
+		pool->start(numThread, [=](unsigned i) -> int64_t {
+			File *file = workerFile(i, type, queueDepth);
+			FileIoUring *async = (type == FILE_IOURING) ? dynamic_cast<FileIoUring *>(file) : nullptr; // emulated devices are always synchronous
+			int64_t res = async ? do_fileAsync(async, endTime, work, workers[i]) : do_file(file, endTime, work, workers[i]);
+			if(workers[i].trace) workers[i].trace->close(); // a finished worker must not hold up the trace merge
+			return res;
+		});
+	}
+	std::vector<int64_t> finish() {
+		std::vector<int64_t> res = pool->wait();
+		stopSampler();
+		if(trace && !trace->endPhase()) cerr << "Error writing the trace" << endl;
+		return res;
+	}
+
+	// How closely an open-loop phase kept to its schedule
+	void addScheduleResults(std::ostringstream &os, const Workload &work, double secs) {
+		uint64_t ops = 0, late = 0, maxLag = 0;
+		for( auto &iter : workers ) { ops += iter.pacedOps; late += iter.lateOps; maxLag = std::max(maxLag, iter.maxLagNs); }
+		os << std::endl << "  schedule: target=" << work.targetIops << "IOPS achieved=" << ops / secs << "IOPS late=" << (ops ? 100.0 * late / ops : 0) << "% max lag=" << maxLag / 1000.0 << "us";
+	}
+	void addScheduleMetrics(JsonValue &metrics, double secs) {
+		std::vector<double> iops, latePct;
+		uint64_t ops = 0, late = 0;
+		for( auto &iter : workers ) {
+			iops.push_back(iter.pacedOps / secs);
+			latePct.push_back(iter.pacedOps ? 100.0 * iter.lateOps / iter.pacedOps : 0);
+			ops += iter.pacedOps;
+			late += iter.lateOps;
+		}
+		metrics["achieved_iops"] = makeMetric(ops / secs, "IOPS", true, iops);
+		metrics["late_pct"] = makeMetric(ops ? 100.0 * late / ops : 0, "%", false, latePct);
+	}
+
+	// Percentiles of the merged histogram, with each worker's own percentile as a sample for baseline comparisons
+	void addLatencyMetrics(JsonValue &metrics, const std::string &op, const LatencyHistogram &hist, int opIdx) {
+		static const std::pair<const char *, double> pcts[] = { {"p50", 50}, {"p90", 90}, {"p99", 99}, {"p99.9", 99.9}, {"p99.99", 99.99} };
+		metrics[op + "_latency_min_us"] = makeMetric(hist.min() / 1000.0, "us", false);
+		for( auto &iter : pcts ) {
+			std::vector<double> samples;
+			for( auto &worker : workers ) if(worker.latency[opIdx].count()) samples.push_back(worker.latency[opIdx].percentile(iter.second) / 1000.0);
+			metrics[op + "_latency_" + iter.first + "_us"] = makeMetric(hist.percentile(iter.second) / 1000.0, "us", false, samples);
+		}
+		metrics[op + "_latency_max_us"] = makeMetric(hist.max() / 1000.0, "us", false);
+		metrics[op + "_ops"] = makeMetric((double) hist.count(), "ops", true);
+	}
+
+	void stopSampler() {
+		if(!sampler.joinable()) return;
+		sampling = false;
+		sampler.join();
+	}
+
+	// Diffs the workers' counters once per interval without stopping them
+	void sampleLoop() {
+		std::vector<LatencyHistogram> last(workers.size() * 2);
+		uint64_t lastBytes[2] = { 0, 0 };
+		auto startTime = std::chrono::steady_clock::now();
+		auto next = startTime;
+		double lastElapsed = 0;
+		while(sampling) {
+			next += std::chrono::milliseconds(sampleMs);
+			while(sampling && std::chrono::steady_clock::now() < next) std::this_thread::sleep_for(std::min(std::chrono::milliseconds(sampleMs), std::chrono::milliseconds(10)));
+			if(!sampling) break;
+			double elapsed = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startTime).count();
+			double secs = (elapsed - lastElapsed) / 1000.0;
+			lastElapsed = elapsed;
+			for(int op = 0; op < 2; op++) {
+				LatencyHistogram interval;
+				uint64_t bytes = 0;
+				for(size_t w = 0; w < workers.size(); w++) {
+					interval.mergeSince(workers[w].latency[op], last[w * 2 + op]);
+					bytes += workers[w].bytes[op].load(std::memory_order_relaxed);
+				}
+				uint64_t deltaBytes = bytes - lastBytes[op];
+				lastBytes[op] = bytes;
+				if(interval.count() == 0) continue;
+				const char *opName = op ? "read" : "write";
+				if(sampleJson) {
+					*sampleOut << "{\"phase\":" << phaseNum << ",\"op\":\"" << opName << "\",\"elapsed_ms\":" << elapsed << ",\"bytes\":" << deltaBytes << ",\"ops\":" << interval.count()
+						<< ",\"MBps\":" << deltaBytes / secs / (1024*1024) << ",\"IOPS\":" << interval.count() / secs << ",\"min_us\":" << interval.min() / 1000.0
+						<< ",\"p50_us\":" << interval.percentile(50) / 1000.0 << ",\"p90_us\":" << interval.percentile(90) / 1000.0 << ",\"p99_us\":" << interval.percentile(99) / 1000.0
+						<< ",\"p99.9_us\":" << interval.percentile(99.9) / 1000.0 << ",\"max_us\":" << interval.max() / 1000.0 << '}' << std::endl;
+				} else {
+					*sampleOut << phaseNum << ',' << opName << ',' << elapsed << ',' << deltaBytes << ',' << interval.count() << ',' << deltaBytes / secs / (1024*1024) << ','
+						<< interval.count() / secs << ',' << interval.min() / 1000.0 << ',' << interval.percentile(50) / 1000.0 << ',' << interval.percentile(90) / 1000.0 << ','
+						<< interval.percentile(99) / 1000.0 << ',' << interval.percentile(99.9) / 1000.0 << ',' << interval.max() / 1000.0 << std::endl;
+				}
+			}
+		}
+	}
 };
 
 class Test_Throughput : public Test {
 public:
-	Test_Throughput(const char *fileName) : Test(fileName) { }
+	Test_Throughput(const char *fileName) : Test_Throughput(fileName, 0) { }
 
 	virtual std::string resultAsString(uint64_t res) override {
 		if(res) { std::ostringstream os; os << res/(1024*1024) << "MB/s"; return os.str(); }
 		return "Failed";
 	}
+	void addResultMetrics(JsonValue &metrics, const std::vector<int64_t> &perThread, uint64_t avg) override {
+		std::vector<double> samples;
+		for( auto iter : perThread ) samples.push_back(iter / (1024.0*1024));
+		metrics["throughput_MBps"] = makeMetric(avg / (1024.0*1024), "MB/s per thread", true, samples);
+	}
 
 	void generateLocs(double percentUtil) override {
-		std::set<TXLocs_t> newSet;
-		std::ranlux48_base rngGen(1);
-		uint64_t totalSize = 0;
-		uint64_t desiredSize = fSize * percentUtil / 100;
-		while (totalSize < desiredSize) totalSize += addLocToSet(newSet, rngGen, fSize) * CHUNK_SIZE;
+		if(compactLocs) {
+			allocator.generateCompact(percentUtil, 1);
+			std::vector<TXLocs_t>().swap(locations);
+		} else allocator.generate(locations, percentUtil, 1);
+		refreshLocs();
 
-		refreshLocs(newSet);
+//	for(auto iter : locations) cout << '(' << iter.offset << ',' << (int)iter.numChunks << ')' << endl;
+	}
 
-//	for(auto iter : newSet) cout << '(' << iter.offset << ',' << (int)iter.numChunks << ')' << endl;
-//	cout << "Desired %: " << (int)percentUtil << " actual %: " << 100*totalSize / fileSize << endl;
+	void setRegion(uint64_t start, uint64_t length) override {
+		Test::setRegion(start, length);
+		allocator = SlotAllocator(fSize, fixedChunks ? fixedChunks : UINT8_MAX, fixedChunks != 0);
 	}
 
 	void updateLocs(double percentChange) override {
-		std::set<TXLocs_t> newSet;
+		if(compactLocs) allocator.updateCompact(percentChange, rand());
+		else allocator.update(locations, percentChange, rand());
+		refreshLocs();
+	}
+
+	bool cacheResidency(bool byAccess, double &pct) override {
+		std::unique_ptr<File> file = openFile<FileUnbuffered>(fname.c_str());
+		return file->getSize() != 0 && cacheResidency(*file, byAccess, pct);
+	}
+
+	int64_t warmCache(double targetPct, const std::chrono::steady_clock::time_point endTime, double &pct) override {
+		std::unique_ptr<File> file = openFile<FileUnbuffered>(fname.c_str());
+		if (file->getSize() == 0) { cerr << "Can't open file: " << fname << endl; return -1; }
+		BufferArena::Slab bufSlab = BufferArena::local().slab((size_t) maxChunks * CHUNK_SIZE);
+		char *buf = bufSlab.data();
+		if (buf == nullptr) { cerr << "Failed allocating buffer" << endl; return -1; }
 		std::ranlux48_base rngGen(rand());
-		auto it = locations.begin();
-		while (it != locations.end()) {
-			if ((uint64_t) 100 * rand() / RAND_MAX < percentChange) {
-				while (addLocToSet(newSet, rngGen, fSize) == 0); // try until we add one
-			} else newSet.insert(*it);
-			it++;
+		AccessPicker picker(dist, numLocs(), rngGen);
+		int64_t bytesRead = 0;
+		while (true) {
+			if (!cacheResidency(*file, true, pct)) return -1;
+			auto now = std::chrono::steady_clock::now();
+			if (pct >= targetPct || now >= endTime) return bytesRead;
+			// probe often enough not to overshoot the target by much
+			auto probeTime = std::min(endTime, now + std::chrono::milliseconds(100));
+			while (std::chrono::steady_clock::now() < probeTime) {
+				TXLocs_t loc = locAt(picker.next(rngGen));
+				ssize_t len = (ssize_t) loc.numChunks * CHUNK_SIZE;
+				if (file->read(buf, len, loc.offset) != len) { cerr << "Error in cache warming read: " << strerror(errno) << endl; return -1; }
+				bytesRead += len;
+			}
 		}
-
-		refreshLocs(newSet);
 	}
 
 protected:
-	class TXLocs_t {
-		public:
-			off64_t offset;
-			uint8_t numChunks; // 8bits * CHUNK_SIZE makes max TX size 1MB
-			bool operator<(const TXLocs_t& rhs) const { return this->offset < rhs.offset; }
-	};
+	static const unsigned CACHE_SAMPLES = 65536;
+
+	// Probes the locations in offset order, so the file's probe mapping is reused between neighbours
+	bool cacheResidency(File &file, bool byAccess, double &pct) {
+		std::vector<TXLocs_t> sample;
+		uint64_t total = numLocs();
+		if (byAccess) {
+			std::ranlux48_base rngGen(1); // the same draws every time, so successive probes compare
+			AccessPicker picker(dist, total, rngGen);
+			for (unsigned i = 0; i < CACHE_SAMPLES; i++) sample.push_back(locAt(picker.next(rngGen)));
+		} else {
+			uint64_t count = std::min<uint64_t>(total, CACHE_SAMPLES);
+			for (uint64_t i = 0; i < count; i++) sample.push_back(locAt(i * total / count));
+		}
+		std::sort(sample.begin(), sample.end());
+		size_t residentPages = 0, totalPages = 0;
+		for (auto &iter : sample) {
+			size_t resident, pages;
+			if (file.cachedPages(iter.offset, (size_t) iter.numChunks * CHUNK_SIZE, resident, pages) != 0) return false;
+			residentPages += resident;
+			totalPages += pages;
+		}
+		pct = totalPages ? 100.0 * residentPages / totalPages : 0;
+		return true;
+	}
+
+	// Extents are at most 'fixedChunks' long, or exactly that long when it is non-zero
+	Test_Throughput(const char *fileName, uint8_t fixedChunks) : Test(fileName), fixedChunks(fixedChunks), allocator(fSize, fixedChunks ? fixedChunks : UINT8_MAX, fixedChunks != 0) { }
+
+	uint8_t fixedChunks;
+	SlotAllocator allocator;
 	std::vector<TXLocs_t> locations;
 	uint8_t maxChunks = 0;
-	unique_ptr<void, voidPtrDeleter> testPtr; // make smart ptr remember to free the memory
 
-	int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, bool isRead) override {
+	inline uint64_t numLocs() const { return compactLocs ? allocator.getNumCompact() : locations.size(); }
+	inline TXLocs_t locAt(uint64_t idx) const {
+		TXLocs_t loc = compactLocs ? allocator.locate(idx) : locations[idx];
+		loc.offset += regionStart;
+		return loc;
+	}
+
+	int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
 		if (file->getSize() == 0) { cerr << "error opening file" << endl; return -1; }
+		BufferArena::Slab bufSlab = BufferArena::local().slab((size_t) maxChunks * CHUNK_SIZE);
+		char *buf = bufSlab.data();
+		if (buf == nullptr) { cerr << "Failed allocating buffer" << endl; return -1; }
 		std::ranlux48_base rngGen(rand());
-		uint64_t vectIdx;
-		uint64_t chunksWritten = 0;
+		AccessPicker picker(dist, numLocs(), rngGen);
+		uint64_t bytesDone = 0;
 		auto startTime = std::chrono::steady_clock::now();
-		while (std::chrono::steady_clock::now() < endTime) {
-			vectIdx = rngGen() % locations.size();
+		auto opStart = startTime;
+		bool paced = work.targetIops > 0;
+		Pacer pacer(paced ? work.targetIops / workers.size() : 1, work.poisson, startTime, rngGen());
+		std::chrono::steady_clock::time_point intended;
+		while (opStart < endTime) {
+			if (paced) {
+				intended = pacer.next();
+				if (intended >= endTime) break;
+				Pacer::waitUntil(intended);
+				opStart = std::chrono::steady_clock::now();
+				stats.addLag(std::chrono::duration_cast<std::chrono::nanoseconds >(opStart - intended).count(), pacer.getIntervalNs());
+			}
+			TXLocs_t loc = locAt(picker.next(rngGen));
+			bool isRead = work.nextIsRead(rngGen);
+			ssize_t len = work.opLen(isRead, loc.numChunks);
+			if (stats.trace) stats.trace->record(opStart, !isRead, loc.offset, len);
 			if (isRead) {
-				if (file->read((char *) testPtr.get(), (ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE, locations[vectIdx].offset) != ((ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE))
+				if (file->read(buf, len, loc.offset) != len)
 					{ cerr << "error: " << strerror(errno) << endl; return -1; }
 			} else {
-				if (file->write((char *) testPtr.get(), (ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE, locations[vectIdx].offset) != ((ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE))
+				if (file->write(buf, len, loc.offset) != len)
 					{ cerr << "error: " << strerror(errno) << endl; return -1; }
 			}
-			chunksWritten += locations[vectIdx].numChunks;
+			auto opEnd = std::chrono::steady_clock::now();
+			stats.latency[isRead].record(std::chrono::duration_cast<std::chrono::nanoseconds >(opEnd - (paced ? intended : opStart)).count());
+			stats.addBytes(isRead, len);
+			bytesDone += len;
+			opStart = opEnd;
 		}
-		return (chunksWritten*CHUNK_SIZE) / (std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startTime).count() / 1000.0);
-	}
-
-	virtual uint8_t addLocToSet(std::set<TXLocs_t> &newSet, std::ranlux48_base &rngGen, uint64_t fileSize) {
-		TXLocs_t nextLoc;
-		nextLoc.offset = rngGen() % fileSize;
-		nextLoc.offset -= nextLoc.offset % CHUNK_SIZE; // snap to mem boundary
-		nextLoc.numChunks = rngGen();
-		if (newSet.size()) {
-			auto it = newSet.upper_bound(nextLoc);
-			auto itBefore = it;
-			itBefore--;
-			// Overlapping times: taken from http://stackoverflow.com/questions/325933/determine-whether-two-date-ranges-overlap
-			if ((itBefore->offset <= nextLoc.offset) && (itBefore->offset + itBefore->numChunks * CHUNK_SIZE > nextLoc.offset))
-				nextLoc.offset = itBefore->offset + itBefore->numChunks * CHUNK_SIZE;
-			if (it->offset <= nextLoc.offset + nextLoc.numChunks * CHUNK_SIZE) nextLoc.numChunks = (it->offset - nextLoc.offset) / CHUNK_SIZE;
+		if (paced) opStart = std::chrono::steady_clock::now();
+		return bytesDone / (std::chrono::duration_cast<std::chrono::milliseconds >(opStart - startTime).count() / 1000.0);
+	}
+
+	int64_t do_fileAsync(FileIoUring *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
+		if (file->getSize() == 0) { cerr << "error opening file" << endl; return -1; }
+		// one buffer per queue slot, registered with the ring as a single region
+		BufferArena::Slab bufs = BufferArena::local().slab((size_t) maxChunks * CHUNK_SIZE, file->getQueueDepth());
+		if (!bufs) { cerr << "Failed allocating buffer" << endl; return -1; }
+		struct iovec iov = { bufs.data(), bufs.bytes() };
+		int bufIndex = file->registerBuffers(&iov, 1) ? 0 : -1;
+		std::vector<FileIoUring::Completion> done(file->getQueueDepth());
+		std::vector<std::chrono::steady_clock::time_point> issued(file->getQueueDepth());
+		std::vector<ssize_t> issuedLen(file->getQueueDepth());
+		std::vector<bool> issuedRead(file->getQueueDepth());
+		std::vector<unsigned> freeSlots(file->getQueueDepth());
+		for (unsigned i = 0; i < freeSlots.size(); i++) freeSlots[i] = i;
+		std::ranlux48_base rngGen(rand());
+		AccessPicker picker(dist, numLocs(), rngGen);
+		uint64_t bytesDone = 0;
+		bool running = true;
+		auto startTime = std::chrono::steady_clock::now();
+		auto now = startTime;
+		bool paced = work.targetIops > 0;
+		Pacer pacer(paced ? work.targetIops / workers.size() : 1, work.poisson, startTime, rngGen());
+		while (running || file->inFlight()) {
+			running = running && (now < endTime) && (!paced || pacer.peek() < endTime);
+			if (!running && !file->inFlight()) break; // nothing left to wait for
+			while (running && !freeSlots.empty()) {
+				if (paced && pacer.peek() > now) break;
+				unsigned slot = freeSlots.back();
+				freeSlots.pop_back();
+				TXLocs_t loc = locAt(picker.next(rngGen));
+				bool isRead = work.nextIsRead(rngGen);
+				issuedRead[slot] = isRead;
+				issuedLen[slot] = work.opLen(isRead, loc.numChunks);
+				issued[slot] = now;
+				if (paced) {
+					issued[slot] = pacer.next();
+					stats.addLag(std::chrono::duration_cast<std::chrono::nanoseconds >(now - issued[slot]).count(), pacer.getIntervalNs());
+				}
+				if (stats.trace) stats.trace->record(now, !isRead, loc.offset, issuedLen[slot]);
+				file->prepare(isRead, bufs.at(slot), issuedLen[slot], loc.offset, slot, bufIndex);
+			}
+			// open loop must not block past the next send time: wait for a completion until shortly before it
+			// and spin the rest, like Pacer::waitUntil(), which also covers the gaps with nothing in flight
+			int ret;
+			if (paced && running) {
+				auto sendTime = std::min(pacer.peek(), endTime);
+				if (!file->inFlight()) { Pacer::waitUntil(sendTime); ret = file->submit(0); }
+				else if (sendTime - std::chrono::steady_clock::now() > std::chrono::microseconds(200)) ret = file->submitUntil(sendTime - std::chrono::microseconds(100));
+				else { ret = file->submit(0); std::this_thread::yield(); }
+			} else ret = file->submit(file->inFlight() ? 1 : 0); // an empty ring would never return
+			if (ret < 0) { cerr << "error: " << strerror(errno) << endl; return -1; }
+			unsigned numDone = file->reap(done.data(), done.size());
+			now = std::chrono::steady_clock::now();
+			for (unsigned i = 0; i < numDone; i++) {
+				unsigned slot = done[i].tag;
+				if (done[i].res != issuedLen[slot]) { cerr << "error: " << strerror(done[i].res < 0 ? -done[i].res : EIO) << endl; return -1; }
+				stats.latency[issuedRead[slot]].record(std::chrono::duration_cast<std::chrono::nanoseconds >(now - issued[slot]).count());
+				stats.addBytes(issuedRead[slot], issuedLen[slot]);
+				bytesDone += issuedLen[slot];
+				freeSlots.push_back(slot);
+			}
 		}
-		if (nextLoc.numChunks) newSet.insert(nextLoc);
-		return nextLoc.numChunks;
+		return bytesDone / (std::chrono::duration_cast<std::chrono::milliseconds >(now - startTime).count() / 1000.0);
 	}
 
-	void refreshLocs(const std::set<TXLocs_t> &newSet) {
-		locations.clear();
-		locations.reserve(newSet.size());
-		maxChunks = 0;
-		for (auto iter : newSet) { locations.push_back(iter); if(maxChunks < iter.numChunks) maxChunks = iter.numChunks; }
-		void *testMem;
-		if (posix_memalign(&testMem, 4096, maxChunks * CHUNK_SIZE)) { cerr << "Failed aligning memory" << strerror(errno) << endl; return; }
-		testPtr = std::unique_ptr<void,voidPtrDeleter>(testMem);
+	void refreshLocs() {
+		maxChunks = compactLocs ? allocator.getSlotChunks() : 0;
+		for (auto &iter : locations) if(maxChunks < iter.numChunks) maxChunks = iter.numChunks;
 	}
 };
 
 class Test_ResponseTime : public Test_Throughput {
 public:
-	Test_ResponseTime(const char *fileName, uint8_t numChunks) : Test_Throughput(fileName), numChunks(numChunks) { }
+	Test_ResponseTime(const char *fileName, uint8_t numChunks) : Test_Throughput(fileName, numChunks), numChunks(numChunks) { }
 
 	virtual std::string resultAsString(uint64_t res) override {
 		if(res) { std::ostringstream os; os << (res / 1000.0) << "ms"; return os.str(); }
 		return "Failed";
 	}
+	void addResultMetrics(JsonValue &metrics, const std::vector<int64_t> &perThread, uint64_t avg) override {
+		std::vector<double> samples;
+		for( auto iter : perThread ) samples.push_back(iter);
+		metrics["mean_latency_us"] = makeMetric(avg, "us", false, samples);
+	}
 
 protected:
 	uint8_t numChunks;
 
-	int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, bool isRead) override {
-		if (file->getSize() == 0) { cerr << "error opening file" << endl; return -1; }
-		std::ranlux48_base rngGen(rand());
-		uint64_t vectIdx = rngGen() % locations.size();
-		uint64_t chunksWritten = 0;
-		uint64_t numTX = 0;
+	// Same engine as Test_Throughput; the result is the mean latency in microseconds
+	int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
+		if (Test_Throughput::do_file(file, endTime, work, stats) < 0) return -1;
+		return meanLatency(stats) / 1000;
+	}
+
+	int64_t do_fileAsync(FileIoUring *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
+		if (Test_Throughput::do_fileAsync(file, endTime, work, stats) < 0) return -1;
+		return meanLatency(stats) / 1000;
+	}
+
+	// Mean over both op types, in ns
+	static double meanLatency(const WorkerStats &stats) {
+		uint64_t ops = stats.latency[0].count() + stats.latency[1].count();
+		return ops ? (stats.latency[0].mean() * stats.latency[0].count() + stats.latency[1].mean() * stats.latency[1].count()) / ops : 0;
+	}
+};
+
+// Reissues a recorded trace. Stream s is replayed by worker s % numThreads, one op
+// at a time, so each stream keeps its original order. 'speed' scales the recorded
+// timing (2 = twice as fast) and 0 sends every op as soon as the worker is free.
+// Offsets past the end of this device wrap around; in the O_DIRECT modes ops are
+// widened to whole chunks.
+class Test_Replay : public Test_Throughput {
+public:
+	Test_Replay(const char *fileName, double speed) : Test_Throughput(fileName), speed(speed) { }
+
+	bool open(const std::string &path, std::string &err) { return reader.open(path, err); }
+	// What to pass to do_testAsString(): the trace's read share, and its rate when timed
+	Workload workload() const {
+		const TraceHeader &hdr = reader.header();
+		uint64_t ops = hdr.readOps + hdr.writeOps;
+		Workload work(ops ? 100.0 * hdr.readOps / ops : 100, 0, 0);
+		if(speed > 0 && hdr.durationNs) work.targetIops = ops * 1e9 / hdr.durationNs * speed;
+		return work;
+	}
+
+protected:
+	TraceReader reader;
+	double speed;
+
+	int64_t do_file(File *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
+		if (file->getSize() < CHUNK_SIZE) { cerr << "error opening file" << endl; return -1; }
+		const TraceHeader &hdr = reader.header();
+		unsigned idx = &stats - workers.data();
+		unsigned numWorkers = workers.size();
+		bool direct = dynamic_cast<FileDirect *>(file) || dynamic_cast<FileIoUring *>(file);
+		uint64_t maxLen = std::min<uint64_t>((std::max<uint64_t>(hdr.maxLength, 1) + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE, file->getSize() - file->getSize() % CHUNK_SIZE);
+		BufferArena::Slab bufSlab = BufferArena::local().slab(maxLen);
+		char *buf = bufSlab.data();
+		if (buf == nullptr) { cerr << "Failed allocating buffer" << endl; return -1; }
+		uint64_t lateNs = (work.targetIops > 0) ? 1e9 / (work.targetIops / numWorkers) : 0;
+		uint64_t bytesDone = 0, traceNs = 0;
 		auto startTime = std::chrono::steady_clock::now();
-		while ((startTime = std::chrono::steady_clock::now()) < endTime) {
-			if (isRead) {
-				if (file->read((char *) testPtr.get(), (ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE, locations[vectIdx].offset) != ((ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE))
-				{ cerr << "error: " << strerror(errno) << endl; return -1; }
-			} else {
-				if (file->write((char *) testPtr.get(), (ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE, locations[vectIdx].offset) != ((ssize_t) locations[vectIdx].numChunks * CHUNK_SIZE))
-				{ cerr << "error: " << strerror(errno) << endl; return -1; }
+		auto opStart = startTime, intended = startTime;
+		// every worker walks the mapped trace itself: memory stays at a buffer per worker however long the trace
+		for (const TraceRecord *rec = reader.begin(); rec != reader.end(); rec++) {
+			traceNs += rec->deltaNs;
+			if (rec->op() == TraceRecord::GAP) { traceNs += rec->gapNs(); continue; }
+			if (rec->stream() % numWorkers != idx) continue;
+			if (speed > 0) {
+				intended = startTime + std::chrono::nanoseconds((uint64_t) (traceNs / speed));
+				if (intended >= endTime) break;
+				Pacer::waitUntil(intended);
 			}
-			chunksWritten += std::chrono::duration_cast<std::chrono::nanoseconds >(std::chrono::steady_clock::now() - startTime).count() / 1000.0;
-			numTX++;
-			vectIdx = rngGen() % locations.size();
-		}
-		return chunksWritten / numTX;
-	}
-
-	uint8_t addLocToSet(std::set<TXLocs_t> &newSet, std::ranlux48_base &rngGen, uint64_t fileSize) override {
-		TXLocs_t nextLoc;
-		nextLoc.offset = rngGen() % fileSize;
-		nextLoc.offset -= nextLoc.offset % CHUNK_SIZE; // snap to mem boundary
-		nextLoc.numChunks = numChunks;
-		if (newSet.size()) {
-			auto it = newSet.upper_bound(nextLoc);
-			auto itBefore = it;
-			itBefore--;
-			// Overlapping times: taken from http://stackoverflow.com/questions/325933/determine-whether-two-date-ranges-overlap
-			if ((itBefore->offset <= nextLoc.offset) && (itBefore->offset + itBefore->numChunks * CHUNK_SIZE > nextLoc.offset))
-				nextLoc.offset = itBefore->offset + itBefore->numChunks * CHUNK_SIZE;
-			if (it->offset <= nextLoc.offset + nextLoc.numChunks * CHUNK_SIZE) nextLoc.numChunks = 0;
+			opStart = std::chrono::steady_clock::now();
+			if (opStart >= endTime) break;
+			if (speed > 0) stats.addLag(std::chrono::duration_cast<std::chrono::nanoseconds >(opStart - intended).count(), lateNs);
+			bool isRead = rec->op() == TraceRecord::READ;
+			uint64_t len = std::max<uint32_t>(rec->length, 1);
+			uint64_t offset = rec->offset() % file->getSize();
+			if (direct) {
+				offset -= offset % CHUNK_SIZE;
+				len = (len + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE;
+			}
+			len = std::min(len, maxLen);
+			if (offset + len > file->getSize()) offset = (file->getSize() - len) / CHUNK_SIZE * CHUNK_SIZE;
+			if (stats.trace) stats.trace->record(opStart, !isRead, offset, len);
+			ssize_t res = isRead ? file->read(buf, len, offset) : file->write(buf, len, offset);
+			if (res != (ssize_t) len) { cerr << "error: " << strerror(errno) << endl; return -1; }
+			auto opEnd = std::chrono::steady_clock::now();
+			stats.latency[isRead].record(std::chrono::duration_cast<std::chrono::nanoseconds >(opEnd - (speed > 0 ? intended : opStart)).count());
+			stats.addBytes(isRead, len);
+			bytesDone += len;
 		}
-		if (nextLoc.numChunks) newSet.insert(nextLoc);
-		return nextLoc.numChunks;
+		auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startTime).count();
+		return bytesDone / (std::max<int64_t>(elapsed, 1) / 1000.0);
+	}
+
+	// Replay is always one op at a time per worker, to keep each stream in order
+	int64_t do_fileAsync(FileIoUring *file, const std::chrono::steady_clock::time_point endTime, const Workload &work, WorkerStats &stats) override {
+		return do_file(file, endTime, work, stats);
 	}
 };
+
+#endif
@@ -0,0 +1,270 @@
+/* Test program created by: Fekete, Andras
+	 Copyright 2016
+	 This program writes a set of random byte sequences in random locations on
+	 the nbd disk and then reads them back to make sure they're correctly written.
+
+	 This program is free software: you can redistribute it and/or modify
+	 it under the terms of the GNU General Public License as published by
+	 the Free Software Foundation, either version 3 of the License, or
+	 (at your option) any later version.
+
+	 This program is distributed in the hope that it will be useful,
+	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	 GNU General Public License for more details.
+
+	 You should have received a copy of the GNU General Public License
+	 along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISKSYSTEMTEST_TRACE_H
+#define DISKSYSTEMTEST_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+// Trace file: one TraceHeader, then TraceRecords in the order they were issued.
+// Both are in host byte order (little endian everywhere we run).
+struct TraceHeader {
+	char magic[8];        // "DSTTRACE"
+	uint32_t version;     // TRACE_VERSION
+	uint32_t recordSize;  // sizeof(TraceRecord)
+	uint64_t deviceSize;  // size of the device the trace was recorded on
+	uint64_t readOps;
+	uint64_t writeOps;
+	uint64_t durationNs;  // from the first record to the last
+	uint64_t maxLength;   // longest op in bytes
+	uint64_t reserved;
+};
+static_assert(sizeof(TraceHeader) == 64, "trace header layout");
+#define TRACE_MAGIC "DSTTRACE"
+#define TRACE_VERSION 1
+
+// 16 bytes per op. 'deltaNs' is the time since the previous record of any stream;
+// a gap too long for it is carried by GAP records, whose offset field holds the
+// extra nanoseconds (several GAPs in a row for more than 48 bits' worth). A stream
+// is the worker that issued the op.
+struct TraceRecord {
+	enum Op_t { READ = 0, WRITE = 1, GAP = 2 };
+	uint64_t word;    // bits 0-1 op, 2-15 stream, 16-63 offset in 512 byte sectors
+	uint32_t length;  // bytes
+	uint32_t deltaNs;
+
+	inline Op_t op() const { return (Op_t) (word & 3); }
+	inline unsigned stream() const { return (word >> 2) & 0x3FFF; }
+	inline uint64_t offset() const { return (word >> 16) * 512; }
+	inline uint64_t gapNs() const { return word >> 16; }
+	static const uint64_t MAX_GAP_NS = (1ULL << 48) - 1;
+	static inline uint64_t pack(Op_t op, unsigned stream, uint64_t sectors) { return (uint64_t) op | ((uint64_t) (stream & 0x3FFF) << 2) | (sectors << 16); }
+};
+static_assert(sizeof(TraceRecord) == 16, "trace record layout");
+
+// Records the ops of every phase into a trace file. Each worker appends to its own
+// Stream without locking; full blocks are handed over and merged into time order
+// as soon as every stream still running has supplied ops up to that time, so memory
+// stays at a few blocks per stream however long the run is. A worker closes its
+// stream when it is done, so that it stops holding up the others.
+class TraceWriter {
+	struct Op { uint64_t ns; uint64_t offset; uint32_t length; bool isWrite; };
+	static const size_t BLOCK_OPS = 16384;
+	static const uint64_t BLOCK_NS = 100000000; // 100ms
+public:
+	class Stream {
+	public:
+		inline void record(std::chrono::steady_clock::time_point when, bool isWrite, uint64_t offset, uint32_t length) {
+			uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+			if(ops.empty()) firstNs = ns;
+			ops.push_back({ ns, offset, length, isWrite });
+			// a slow stream hands over part-filled blocks too, or it would hold the merge up
+			if(ops.size() >= BLOCK_OPS || ns - firstNs > BLOCK_NS) owner->submit(*this);
+		}
+		// No more ops from this stream in this phase
+		void close() { owner->submit(*this, true); }
+	private:
+		friend class TraceWriter;
+		TraceWriter *owner = nullptr;
+		unsigned idx = 0;
+		std::vector<Op> ops;
+		uint64_t firstNs = 0;
+	};
+
+	TraceWriter() { }
+	TraceWriter(const TraceWriter &) = delete;
+	TraceWriter &operator=(const TraceWriter &) = delete;
+	~TraceWriter() { close(); }
+
+	bool open(const std::string &path, uint64_t deviceSize) {
+		close();
+		fp = fopen(path.c_str(), "wb");
+		if(fp == nullptr) return false;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+		header.version = TRACE_VERSION;
+		header.recordSize = sizeof(TraceRecord);
+		header.deviceSize = deviceSize;
+		started = false;
+		return fwrite(&header, sizeof(header), 1, fp) == 1;
+	}
+	bool isOpen() const { return fp != nullptr; }
+
+	// Finishes the file; the header is rewritten with the final counts
+	bool close() {
+		if(fp == nullptr) return true;
+		flushOut();
+		bool ok = !failed && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = (fclose(fp) == 0) && ok;
+		fp = nullptr;
+		return ok;
+	}
+
+	// Stream 'i' belongs to worker 'i' until endPhase()
+	void beginPhase(unsigned numStreams) {
+		streams.assign(numStreams, Stream());
+		pending.assign(numStreams, std::deque<std::vector<Op> >());
+		pos.assign(numStreams, 0);
+		closed.assign(numStreams, false);
+		for(unsigned i = 0; i < numStreams; i++) {
+			streams[i].owner = this;
+			streams[i].idx = i;
+			streams[i].ops = spareBlock();
+		}
+	}
+	Stream &stream(unsigned i) { return streams[i]; }
+	// Called once the workers are done: merges what is left and writes it out
+	bool endPhase() {
+		std::lock_guard<std::mutex> lock(mtx);
+		for(auto &iter : streams) if(!iter.ops.empty()) pending[iter.idx].push_back(std::move(iter.ops));
+		drain(true);
+		flushOut();
+		return !failed;
+	}
+
+private:
+	void submit(Stream &s, bool last = false) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if(!s.ops.empty()) pending[s.idx].push_back(std::move(s.ops));
+		s.ops = spareBlock();
+		if(last) closed[s.idx] = true;
+		drain(false);
+	}
+	std::vector<Op> spareBlock() {
+		std::vector<Op> res;
+		if(!spare.empty()) { res = std::move(spare.back()); spare.pop_back(); res.clear(); }
+		else res.reserve(BLOCK_OPS);
+		return res;
+	}
+
+	// Emits ops in time order while it is safe: unless 'final', every stream that is not closed must have
+	// something pending, as its next op may come before what the others have
+	void drain(bool final) {
+		while(true) {
+			int best = -1;
+			for(unsigned i = 0; i < pending.size(); i++) {
+				if(pending[i].empty()) { if(!final && !closed[i]) return; continue; }
+				if(best < 0 || pending[i].front()[pos[i]].ns < pending[best].front()[pos[best]].ns) best = i;
+			}
+			if(best < 0) return;
+			std::vector<Op> &block = pending[best].front();
+			emit(block[pos[best]], best);
+			if(++pos[best] == block.size()) {
+				spare.push_back(std::move(block));
+				pending[best].pop_front();
+				pos[best] = 0;
+			}
+		}
+	}
+
+	void emit(const Op &op, unsigned stream) {
+		if(!started) { started = true; firstNs = lastNs = op.ns; }
+		uint64_t delta = op.ns > lastNs ? op.ns - lastNs : 0;
+		while(delta > UINT32_MAX) {
+			uint64_t gap = std::min(delta, TraceRecord::MAX_GAP_NS);
+			out.push_back({ TraceRecord::pack(TraceRecord::GAP, 0, gap), 0, 0 });
+			delta -= gap;
+		}
+		lastNs = std::max(lastNs, op.ns);
+		out.push_back({ TraceRecord::pack(op.isWrite ? TraceRecord::WRITE : TraceRecord::READ, stream, op.offset / 512), op.length, (uint32_t) delta });
+		(op.isWrite ? header.writeOps : header.readOps)++;
+		header.durationNs = lastNs - firstNs;
+		header.maxLength = std::max<uint64_t>(header.maxLength, op.length);
+		if(out.size() >= 4096) flushOut();
+	}
+	void flushOut() {
+		if(fp == nullptr || out.empty()) return;
+		if(fwrite(out.data(), sizeof(TraceRecord), out.size(), fp) != out.size()) failed = true;
+		out.clear();
+	}
+
+	FILE *fp = nullptr;
+	TraceHeader header;
+	bool failed = false;
+	bool started = false;
+	uint64_t firstNs = 0, lastNs = 0;
+	std::mutex mtx;
+	std::vector<Stream> streams;
+	std::vector<std::deque<std::vector<Op> > > pending;
+	std::vector<size_t> pos;
+	std::vector<bool> closed;
+	std::vector<std::vector<Op> > spare;
+	std::vector<TraceRecord> out;
+};
+
+// Read-only view of a trace file. The file is mapped rather than read, so the
+// page cache streams it in and a trace larger than memory costs only what the
+// readers are currently looking at.
+class TraceReader {
+public:
+	TraceReader() { }
+	TraceReader(const TraceReader &) = delete;
+	TraceReader &operator=(const TraceReader &) = delete;
+	~TraceReader() { close(); }
+
+	// Replaces whatever trace was open before; on failure none is
+	bool open(const std::string &path, std::string &err) {
+		close();
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if(fd < 0) { err = strerror(errno); return false; }
+		struct stat st;
+		if(fstat(fd, &st) != 0) { err = strerror(errno); ::close(fd); return false; }
+		if((size_t) st.st_size < sizeof(TraceHeader)) { err = "too short for a trace"; ::close(fd); return false; }
+		void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(addr == MAP_FAILED) { err = strerror(errno); return false; }
+		mem = (char *) addr;
+		size = st.st_size;
+		madvise(mem, size, MADV_SEQUENTIAL);
+		const TraceHeader &hdr = header();
+		if(memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) { err = "not a trace file"; close(); return false; }
+		if(hdr.version != TRACE_VERSION || hdr.recordSize != sizeof(TraceRecord)) { err = "unsupported trace version"; close(); return false; }
+		numRecords = (size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+		return true;
+	}
+	void close() {
+		if(mem != nullptr) munmap(mem, size);
+		mem = nullptr;
+		size = 0;
+		numRecords = 0;
+	}
+
+	const TraceHeader &header() const { return *(const TraceHeader *) mem; }
+	const TraceRecord *begin() const { return (const TraceRecord *) (mem + sizeof(TraceHeader)); }
+	const TraceRecord *end() const { return begin() + numRecords; }
+
+private:
+	char *mem = nullptr;
+	size_t size = 0;
+	uint64_t numRecords = 0;
+};
+
+#endif
@@ -0,0 +1,42 @@
+import matplotlib
+matplotlib.use('Agg')
+import matplotlib.pyplot as plt
+import csv
+import sys
+import os
+
+#plots the CSV written by "diskSystemTest -I <ms> -S <file.csv>"
+#usage: samplePlot.py <samples.csv> [phase]
+#one svg per phase is saved next to the csv: throughput and p99 latency over time
+if len(sys.argv) < 2:
+    print("Usage: " + sys.argv[0] + " <samples.csv> [phase]")
+    sys.exit(1)
+
+series = {}
+with open(sys.argv[1], 'r') as f:
+    reader = csv.DictReader(f)
+    for row in reader:
+        if len(sys.argv) > 2 and row['phase'] != sys.argv[2]:
+            continue
+        key = (row['phase'], row['op'])
+        if key not in series:
+            series[key] = ([], [], [])
+        series[key][0].append(float(row['elapsed_ms']) / 1000)
+        series[key][1].append(float(row['MBps']))
+        series[key][2].append(float(row['p99_us']))
+
+for phase in sorted(set(k[0] for k in series), key=int):
+    fig, (top, bottom) = plt.subplots(2, 1, sharex=True)
+    for (p, op), (t, mbps, p99) in sorted(series.items()):
+        if p != phase:
+            continue
+        top.plot(t, mbps, label=op)
+        bottom.plot(t, p99, label=op)
+    top.set_title('phase ' + phase + ' of ' + os.path.basename(sys.argv[1]))
+    top.set_ylabel('MB/s')
+    bottom.set_ylabel('p99 latency (us)')
+    bottom.set_xlabel('time (s)')
+    top.legend()
+    outImage = os.path.splitext(sys.argv[1])[0] + "_phase" + phase + ".svg"
+    plt.savefig(outImage)
+    plt.close(fig)
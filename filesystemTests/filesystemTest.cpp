@@ -2,14 +2,37 @@
 #include<iostream>
 #include<sstream>
 #include<fstream>
+#include<string>
+#include<vector>
+#include<thread>
+#include<atomic>
+#include<chrono>
+#include<memory>
+#include<functional>
+#include<algorithm>
+#include<cmath>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include "../Pattern.h"
 using namespace std;
 
 //usage syntax
 void usage(char *progName) {
-	cout << "Usage: " << progName << " <r|w|a> <testFilePath>" << endl;
+	cout << "Usage: " << progName << " [OPTIONS] <r|w|a|br|bw|ba> <testFilePath>" << endl;
 	cout << "'r' for read test" << endl;
 	cout << "'w' for write test" << endl;
 	cout << "'a' for both" << endl;
+	cout << "'br', 'bw' and 'ba' do the same with binary files streamed in large buffered I/Os by a pool of threads:" << endl;
+	cout << "\t-n <count>  => Number of files (default=100)" << endl;
+	cout << "\t-z <sizes>  => File sizes: fixed:<size>, uniform:<min>:<max> or lognormal:<median>:<sigma> (default=uniform:1K:1M)" << endl;
+	cout << "\t-i <size>   => Size of each read/write call, a multiple of 8 (default=1M)" << endl;
+	cout << "\t-t <n>      => Writer/reader threads (default=4)" << endl;
+	cout << "\t-S <seed>   => Seed of the sizes and contents (default=1)" << endl;
+	cout << "Sizes take K/M/G suffixes. The data is regenerated from (seed, file, offset) to verify it, so reads check everything they read." << endl;
 }
 
 #define NUM_FILES 100
@@ -62,21 +85,178 @@ bool read_test(const char* path) {
 	return false;
 }
 
+// A byte count with an optional K, M or G suffix
+static bool parseSize(const std::string &val, uint64_t &out) {
+	char *end;
+	double num = strtod(val.c_str(), &end);
+	if(end == val.c_str() || num < 0) return false;
+	std::string unit = end;
+	if(unit == "K" || unit == "k") num *= 1024;
+	else if(unit == "M" || unit == "m") num *= 1024 * 1024;
+	else if(unit == "G" || unit == "g") num *= 1024 * 1024 * 1024;
+	else if(!unit.empty()) return false;
+	out = (uint64_t) num;
+	return true;
+}
+
+// Size of each binary test file, a pure function of (seed, file number) so readers know what to expect
+class SizeDist {
+public:
+	enum Kind_t { FIXED, UNIFORM, LOGNORMAL };
+	Kind_t kind = UNIFORM;
+	uint64_t first = 1024, second = 1024 * 1024; // FIXED: size, UNIFORM: min, max, LOGNORMAL: median
+	double sigma = 1;                            // LOGNORMAL: of the size's logarithm
+
+	// "fixed:<size>", "uniform:<min>:<max>", "lognormal:<median>:<sigma>"
+	static bool parse(const std::string &spec, SizeDist &out) {
+		std::vector<std::string> parts;
+		size_t start = 0, pos;
+		while((pos = spec.find(':', start)) != std::string::npos) { parts.push_back(spec.substr(start, pos - start)); start = pos + 1; }
+		parts.push_back(spec.substr(start));
+		SizeDist dist;
+		if(parts[0] == "fixed" && parts.size() == 2) {
+			dist.kind = FIXED;
+			if(!parseSize(parts[1], dist.first)) return false;
+		} else if(parts[0] == "uniform" && parts.size() == 3) {
+			dist.kind = UNIFORM;
+			if(!parseSize(parts[1], dist.first) || !parseSize(parts[2], dist.second) || dist.second < dist.first) return false;
+		} else if(parts[0] == "lognormal" && parts.size() == 3) {
+			dist.kind = LOGNORMAL;
+			dist.sigma = atof(parts[2].c_str());
+			if(!parseSize(parts[1], dist.first) || dist.first == 0 || dist.sigma < 0) return false;
+		} else return false;
+		out = dist;
+		return true;
+	}
+
+	// Lognormal sizes are capped at 100 times the median so that one file can't take the whole run
+	uint64_t size(uint64_t seed, uint64_t fileNum) const {
+		PatternGen gen(seed, SIZE_PASS, fileNum);
+		switch(kind) {
+			case FIXED: return first;
+			case UNIFORM: return first + std::min<uint64_t>((uint64_t)(gen.fraction(0) * (second - first + 1)), second - first);
+			case LOGNORMAL: {
+					double z = sqrt(-2 * log(1 - gen.fraction(0))) * cos(2 * M_PI * gen.fraction(1)); // Box-Muller
+					return std::min<uint64_t>((uint64_t)(first * exp(sigma * z)), first * 100);
+				}
+		}
+		return 0;
+	}
+
+	static const uint64_t DATA_PASS = 0, SIZE_PASS = 1; // PatternGen streams of the contents and the sizes
+};
+
+struct BinaryConfig {
+	uint64_t files = 100;
+	unsigned threads = 4;
+	uint64_t ioSize = 1024 * 1024;
+	uint64_t seed = 1;
+	SizeDist sizes;
+};
+
+// Streams one file out in 'ioSize' writes and makes it durable. Its pages are then dropped, so
+// the read test that follows reads the filesystem rather than the page cache.
+static bool binary_write_file(const char *path, const BinaryConfig &cfg, uint64_t fileNum, char *buf, uint64_t &bytes) {
+	std::string fname = std::string(path) + "/btest" + std::to_string(fileNum);
+	int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if(fd < 0) { cerr << "Can't open file for write: " << fname << ": " << strerror(errno) << endl; return true; }
+	PatternGen gen(cfg.seed, SizeDist::DATA_PASS, fileNum);
+	uint64_t size = cfg.sizes.size(cfg.seed, fileNum);
+	for(uint64_t offset = 0; offset < size; ) {
+		size_t len = std::min<uint64_t>(cfg.ioSize, size - offset);
+		gen.fill(buf, len, offset);
+		for(size_t done = 0; done < len; ) {
+			ssize_t res = write(fd, buf + done, len - done);
+			if(res <= 0) { cerr << "Write of " << fname << " failed at " << offset + done << ": " << strerror(errno) << endl; close(fd); return true; }
+			done += res;
+		}
+		offset += len;
+	}
+	if(fdatasync(fd) != 0) { cerr << "Sync of " << fname << " failed: " << strerror(errno) << endl; close(fd); return true; }
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	if(close(fd) != 0) { cerr << "Close of " << fname << " failed: " << strerror(errno) << endl; return true; }
+	bytes += size;
+	return false;
+}
+
+// Streams one file back in 'ioSize' reads, checking its size and every byte as it goes
+static bool binary_read_file(const char *path, const BinaryConfig &cfg, uint64_t fileNum, char *buf, uint64_t &bytes) {
+	std::string fname = std::string(path) + "/btest" + std::to_string(fileNum);
+	int fd = open(fname.c_str(), O_RDONLY);
+	if(fd < 0) { cerr << "Can't open file for read: " << fname << ": " << strerror(errno) << endl; return true; }
+	PatternGen gen(cfg.seed, SizeDist::DATA_PASS, fileNum);
+	uint64_t size = cfg.sizes.size(cfg.seed, fileNum);
+	struct stat st;
+	if(fstat(fd, &st) != 0) { cerr << "Can't stat " << fname << ": " << strerror(errno) << endl; close(fd); return true; }
+	if((uint64_t) st.st_size != size) { cerr << "Invalid file written: " << fname << " holds " << st.st_size << " bytes instead of " << size << endl; close(fd); return true; }
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for(uint64_t offset = 0; offset < size; ) {
+		size_t len = std::min<uint64_t>(cfg.ioSize, size - offset);
+		for(size_t done = 0; done < len; ) {
+			ssize_t res = read(fd, buf + done, len - done);
+			if(res <= 0) { cerr << "Read of " << fname << " failed at " << offset + done << ": " << (res == 0 ? "end of file" : strerror(errno)) << endl; close(fd); return true; }
+			done += res;
+		}
+		size_t bad = gen.mismatch(buf, len, offset);
+		if(bad != len) { cerr << "Invalid file written: " << fname << " differs at byte " << offset + bad << endl; close(fd); return true; }
+		offset += len;
+	}
+	close(fd);
+	bytes += size;
+	return false;
+}
+
+// Runs 'work' over every file, 'threads' threads taking the next file number from a shared counter
+static bool binary_test(const char *path, const BinaryConfig &cfg, const char *what, std::function<bool(const char *, const BinaryConfig &, uint64_t, char *, uint64_t &)> work) {
+	std::atomic<uint64_t> next{0};
+	std::atomic<bool> failed{false};
+	std::vector<uint64_t> bytes(cfg.threads, 0);
+	std::vector<std::thread> threads;
+	auto startT = std::chrono::steady_clock::now();
+	for(unsigned t = 0; t < cfg.threads; t++) threads.emplace_back([&](unsigned t) {
+		std::unique_ptr<char[]> buf(new char[cfg.ioSize]);
+		uint64_t i;
+		while(!failed && (i = next++) < cfg.files) if(work(path, cfg, i, buf.get(), bytes[t])) failed = true;
+	}, t);
+	for(auto &iter : threads) iter.join();
+	if(failed) return true;
+	double duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startT).count() / 1e6;
+	uint64_t total = 0;
+	for(auto iter : bytes) total += iter;
+	cout << what << ' ' << cfg.files << " files, " << total / (1024*1024.0) << " MB in " << duration << " seconds: "
+		<< total / (1024*1024.0) / duration << " MB/s, " << cfg.files / duration << " files/s" << endl;
+	return false;
+}
+
 int main( int argc, char* argv[] ) {
-	if(argc != 3) { usage(argv[0]); return 1; }
-	bool doRead = false, doWrite = false;
+	BinaryConfig cfg;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:z:i:t:S:")) != -1) {
+		switch (opt) {
+			case 'n': cfg.files = strtoull(optarg, nullptr, 10); break;
+			case 'z': if(!SizeDist::parse(optarg, cfg.sizes)) { cerr << "Invalid file sizes: " << optarg << endl; usage(argv[0]); return 1; } break;
+			case 'i': if(!parseSize(optarg, cfg.ioSize) || cfg.ioSize == 0 || cfg.ioSize % 8) { cerr << "Invalid I/O size: " << optarg << endl; usage(argv[0]); return 1; } break;
+			case 't': cfg.threads = std::max(atoi(optarg), 1); break;
+			case 'S': cfg.seed = strtoull(optarg, nullptr, 0); break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if(argc - optind != 2) { usage(argv[0]); return 1; }
+	bool doRead = false, doWrite = false, binary = false;
+	string mode = argv[optind];
+	if(mode.size() == 2 && mode[0] == 'b') { binary = true; mode = mode.substr(1); }
 
-	if(string(argv[1]) == "r") doRead = true;
-	else if(string(argv[1]) == "w") doWrite = true;
-	else if(string(argv[1]) == "a") { doRead = true; doWrite = true; }
+	if(mode == "r") doRead = true;
+	else if(mode == "w") doWrite = true;
+	else if(mode == "a") { doRead = true; doWrite = true; }
 	else { usage(argv[0]); return 1; }
 
 	if(doWrite) {
-		if(write_test(argv[argc-1])) { cerr << "Failed write test" << endl; return 1; }
+		if(binary ? binary_test(argv[argc-1], cfg, "Wrote", binary_write_file) : write_test(argv[argc-1])) { cerr << "Failed write test" << endl; return 1; }
 	}
 
 	if(doRead) {
-		if(read_test(argv[argc-1])) { cerr << "Failed read test" << endl; return 1; }
+		if(binary ? binary_test(argv[argc-1], cfg, "Read and verified", binary_read_file) : read_test(argv[argc-1])) { cerr << "Failed read test" << endl; return 1; }
 	}
 
 	cout << "Test completed successfully" << endl;
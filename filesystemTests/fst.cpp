@@ -17,6 +17,16 @@
 #include<assert.h>
 #include<future>
 #include<random>
+#include<cmath>
+#include<thread>
+#include<vector>
+#include <sys/stat.h>
+#include "../File.h"
+#include "../Verify.h"
+#include "../BlockStamp.h"
+#include "../Results.h"
+#include "../Histogram.h"
+#include <getopt.h>
 using namespace std;
 
 #define NUMBUFFERS 10
@@ -24,6 +34,9 @@ using namespace std;
 #define CHUNK_SIZE (1*4096)
 #define ONE_MB ((1024*1024) / CHUNK_SIZE)
 
+// --stamp: chunks are StampedPattern blocks of (file number, offset) instead of shared base buffers
+static bool stamped = false;
+
 //usage syntax
 void usage(char *progName) {
 	cout << "Usage: " << progName << " <OPTIONS>* <testFilePath>" << endl;
@@ -31,11 +44,18 @@ void usage(char *progName) {
 	cout << "\tw         => Perform write of all " << NUM_FILES << " files" << endl;
 	cout << "\tr <count> => Read random 'count' files" << endl;
 	cout << "\tR <n>     => Read 'n'-th test file" << endl;
+	cout << "\tm <count> => Metadata test: create, stat, open, rename and unlink 'count' empty files in a directory tree" << endl;
+	cout << "\t--md-threads <n>         => Threads of the metadata test, each taking its share of the files (default=4)" << endl;
+	cout << "\t--md-tree <fanout>:<depth> => Shape of the metadata test's directory tree (default=16:2, 256 leaf directories; depth 0 puts every file in one flat directory)" << endl;
+	cout << "\t--json <file>     => Write the results of every step as JSON to 'file'" << endl;
+	cout << "\t--baseline <file> => Compare against the JSON results in 'file' and exit with 2 on a regression" << endl;
+	cout << "\t--tolerance <pct> => Changes smaller than 'pct' percent are never a regression (default=5)" << endl;
+	cout << "\t--stamp           => Write/expect chunks that carry their file, offset and a CRC32C, so a bad one says whose data it holds (give it before w/r/R)" << endl;
 	cout << "Note: Multiple options can be passed multiple times. Such as " << progName << " -w -r 10 -R 8 -R 8" << endl;
 	cout << "Chunk size = " << CHUNK_SIZE << endl;
 }
 
-double write_file( const char* path, const vector<unique_ptr<const char>>& base, const uint16_t i) {
+double write_file( const char* path, const BufferArena::Slab &base, const uint16_t i) {
 	std::ostringstream fname;
 	fname << path << "/test" << i;
 	cout << "now writing " << fname.str().c_str() << "..." << endl;
@@ -45,7 +65,15 @@ double write_file( const char* path, const vector<unique_ptr<const char>>& base,
 	if(fd < 0) { cerr << "error opening file: " << strerror(errno) << endl; return NAN; }
 	std::ranlux24_base rngGen(i);
 	int fileSizeMB = (i+1)*10;
-	for(int j = fileSizeMB*ONE_MB; j; j--) if(write(fd,base[rngGen()%NUMBUFFERS].get(), CHUNK_SIZE) != CHUNK_SIZE) { cerr << "error: " << strerror(errno) << endl; return NAN; }
+	BufferArena::Slab chunkSlab = stamped ? BufferArena::local().slab(CHUNK_SIZE) : BufferArena::Slab();
+	char *chunk = chunkSlab.data();
+	if(stamped && chunk == nullptr) { cerr << "Failed allocating buffer" << endl; return NAN; }
+	StampedPattern stamp(i, 0);
+	for(int j = 0; j < fileSizeMB*ONE_MB; j++) {
+		const char *data = base.at(rngGen()%NUMBUFFERS);
+		if(stamped) { stamp.fill(chunk, CHUNK_SIZE, (uint64_t)j * CHUNK_SIZE, j); data = chunk; }
+		if(write(fd,data, CHUNK_SIZE) != CHUNK_SIZE) { cerr << "error: " << strerror(errno) << endl; return NAN; }
+	}
 	//print finish confirmation and speed of writing
 	if(close(fd)<0) { cerr << "error closing file after write" << endl; return NAN; }
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
@@ -54,22 +82,26 @@ double write_file( const char* path, const vector<unique_ptr<const char>>& base,
 }
 
 //write test
-bool write_test( const char* path, const vector<unique_ptr<const char>>& base ) {
+bool write_test( const char* path, const BufferArena::Slab &base, std::vector<double> &speeds ) {
 	std::vector<std::future<double>> procs;
 	for(uint16_t i = 0; i < NUM_FILES; i++ ) procs.push_back(std::async(std::launch::async,[&](uint16_t val) { return write_file(path,base,val); },i ));
-	for(uint16_t i = 0; i < NUM_FILES; i++ ) if(procs[i].get() == NAN) return true;
-	return false;
+	bool failed = false;
+	for(uint16_t i = 0; i < NUM_FILES; i++ ) {
+		double duration = procs[i].get();
+		if(std::isnan(duration)) failed = true;
+		else speeds.push_back((i+1)*10 / duration);
+	}
+	return failed;
 }
 
-struct voidPtrDeleter { void operator()(void *p) { free(p); } };
 //read test
-bool read_file(const char* path, const vector<unique_ptr<const char>>& base, const uint16_t fileNum) {
+bool read_file(const char* path, const BufferArena::Slab &base, const uint16_t fileNum, double *speed = nullptr) {
 	assert(fileNum < NUM_FILES);
 	std::ostringstream fname;
 	fname << path << "/test" << fileNum;
-	void *testStr;
-	if(posix_memalign(&testStr, 4096, CHUNK_SIZE)) { cerr << "Failed aligning memory" << strerror(errno) << endl; return true; }
-	unique_ptr<void,voidPtrDeleter> testPtr(testStr); // make smart ptr remember to free the memory
+	BufferArena::Slab testStrSlab = BufferArena::local().slab(CHUNK_SIZE);
+	char *testStr = testStrSlab.data();
+	if(testStr == nullptr) { cerr << "Failed allocating buffer" << endl; return true; }
 	cout << "now validating " << fname.str().c_str() << "..." << endl;
 	auto startT = std::chrono::steady_clock::now();
 	int fd = open(fname.str().c_str(), O_RDWR | O_LARGEFILE | O_DIRECT);
@@ -83,51 +115,217 @@ bool read_file(const char* path, const vector<unique_ptr<const char>>& base, con
 			if(numRead == 0) break;
 			else cerr << "error reading file " << numRead << " " << strerror(errno) << endl; return true;
 		}
-		if(memcmp(testStr, base[rngGen()%NUMBUFFERS].get(),CHUNK_SIZE)) { cerr << "error validate" << endl; return true; }
+		const char *expected = base.at(rngGen()%NUMBUFFERS);
+		if(stamped) {
+			StampResult res = StampedPattern(fileNum, 0).check(testStr, CHUNK_SIZE, fileSize);
+			if(!res.ok()) {
+				cerr << "error validate at offset " << fileSize << endl << res.describe();
+				return true;
+			}
+		} else if(verifyFirstMismatch(testStr, expected, CHUNK_SIZE) != CHUNK_SIZE) {
+			cerr << "error validate at offset " << fileSize << endl << verifyBuffers(testStr, expected, CHUNK_SIZE).describe();
+			return true;
+		}
 		fileSize += numRead;
 	}
 	if(close(fd)<0) {cerr << "error closing file after read" << endl; return true;}
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds >(std::chrono::steady_clock::now() - startT).count() / 1000.0;
 	cout << "successful read validation at " << fileSize/(duration*1024*1024) << " MB/s" << endl;
+	if(speed != nullptr) *speed = fileSize/(duration*1024*1024);
 	return false;
 }
 
-bool read_test(const char* path, const vector<unique_ptr<const char>>& base, uint16_t numReads) {
+bool read_test(const char* path, const BufferArena::Slab &base, uint16_t numReads, std::vector<double> &speeds) {
 	std::vector<uint16_t> files;
 	while(numReads--) files.push_back(rand() % NUM_FILES);
 	std::vector<std::future<bool>> procs;
-	for(size_t i = 0; i < files.size(); i++) procs.push_back(std::async(std::launch::async, [&](uint16_t val) { return read_file(path,base,val); },i ) );
+	speeds.resize(files.size());
+	for(size_t i = 0; i < files.size(); i++) procs.push_back(std::async(std::launch::async, [&](uint16_t val, double *speed) { return read_file(path,base,val,speed); },i,&speeds[i] ) );
 	for(size_t i = 0; i < files.size(); i++) if(procs[i].get()) return true;
 	return false;
 }
 
+// Metadata test: 'files' empty files spread round robin over the leaves of a directory tree 'fanout'
+// wide and 'depth' deep under <path>/md. Every step is run by all threads at once, each over its own
+// slice of the files, and timed per call like mdtest does, so only the metadata path is measured.
+enum { MD_CREATE, MD_STAT, MD_OPEN, MD_RENAME, MD_UNLINK, MD_NUM_OPS };
+static const char *mdOpNames[MD_NUM_OPS] = { "create", "stat", "open", "rename", "unlink" };
+
+struct MetadataConfig {
+	unsigned threads = 4;
+	unsigned fanout = 16;
+	unsigned depth = 2;
+};
+
+struct MetadataResult {
+	double seconds;
+	std::vector<double> threadRates;  // ops/s of each thread
+	LatencyHistogram latency;
+};
+
+// Creates the tree below 'dir' level by level and returns its leaf directories
+static bool md_make_tree(const std::string &dir, unsigned fanout, unsigned depth, std::vector<std::string> &leaves) {
+	if(mkdir(dir.c_str(), S_IRWXU) != 0 && errno != EEXIST) { cerr << "error creating " << dir << ": " << strerror(errno) << endl; return false; }
+	if(depth == 0) { leaves.push_back(dir); return true; }
+	for(unsigned i = 0; i < fanout; i++) if(!md_make_tree(dir + "/d" + std::to_string(i), fanout, depth - 1, leaves)) return false;
+	return true;
+}
+
+static void md_remove_tree(const std::string &dir, unsigned fanout, unsigned depth) {
+	if(depth > 0) for(unsigned i = 0; i < fanout; i++) md_remove_tree(dir + "/d" + std::to_string(i), fanout, depth - 1);
+	rmdir(dir.c_str());
+}
+
+static bool md_call(int op, const char *name, const char *renamed) {
+	switch(op) {
+		case MD_CREATE: { int fd = open(name, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR); return fd >= 0 && close(fd) == 0; }
+		case MD_STAT: { struct stat st; return stat(name, &st) == 0; }
+		case MD_OPEN: { int fd = open(name, O_RDONLY); return fd >= 0 && close(fd) == 0; }
+		case MD_RENAME: return rename(name, renamed) == 0;
+		default: return unlink(renamed) == 0;
+	}
+}
+
+// Runs one step over all the files; the first failing call of any thread fails the step
+static bool md_step(int op, const std::vector<std::string> &leaves, uint64_t files, unsigned numThreads, MetadataResult &res) {
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<LatencyHistogram>> hists(numThreads);
+	std::vector<double> secs(numThreads);
+	std::atomic<bool> failed{false};
+	auto startT = std::chrono::steady_clock::now();
+	for(unsigned t = 0; t < numThreads; t++) {
+		hists[t] = std::make_unique<LatencyHistogram>();
+		threads.emplace_back([&](unsigned t) {
+			std::string name, renamed;
+			auto threadStart = std::chrono::steady_clock::now();
+			for(uint64_t i = files * t / numThreads; i < files * (t + 1) / numThreads && !failed; i++) {
+				name = leaves[i % leaves.size()] + "/f" + std::to_string(i);
+				renamed = name + ".r";
+				auto opStart = std::chrono::steady_clock::now();
+				if(!md_call(op, name.c_str(), renamed.c_str())) {
+					if(!failed.exchange(true)) cerr << "error in " << mdOpNames[op] << " of " << (op == MD_UNLINK ? renamed : name) << ": " << strerror(errno) << endl;
+					return;
+				}
+				hists[t]->record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - opStart).count());
+			}
+			secs[t] = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - threadStart).count() / 1e6;
+		}, t);
+	}
+	for(auto &iter : threads) iter.join();
+	res.seconds = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startT).count() / 1e6;
+	for(unsigned t = 0; t < numThreads; t++) {
+		res.latency.merge(*hists[t]);
+		if(hists[t]->count()) res.threadRates.push_back(hists[t]->count() / std::max(secs[t], 1e-6));
+	}
+	return !failed;
+}
+
+enum { OPT_STAMP = OPT_RESULTS_END, OPT_MD_THREADS, OPT_MD_TREE };
+static const struct option longOptions[] = {
+	RESULTS_LONG_OPTIONS,
+	{ "stamp", no_argument, nullptr, OPT_STAMP },
+	{ "md-threads", required_argument, nullptr, OPT_MD_THREADS },
+	{ "md-tree", required_argument, nullptr, OPT_MD_TREE },
+	{ nullptr, 0, nullptr, 0 }
+};
+
 int main( int argc, char* argv[] ) {
 	int opt;
 
 	//prepare the base blocks
-	vector<unique_ptr<const char>>base;
+	BufferArena::Slab base = BufferArena::local().slab(CHUNK_SIZE, NUMBUFFERS);
+	if(!base) { cerr << "Failed allocating buffers" << endl; return 1; }
 	for(int i = 0; i < NUMBUFFERS; i++) {
 		srand(i);
-		char *testStr;
-		if(posix_memalign((void **)&testStr, 4096, CHUNK_SIZE)) { cerr << "Failed aligning memory" << strerror(errno) << endl; return 1; }
-		for(int j = 0; j < CHUNK_SIZE; j++) ((char *)testStr)[j] = 'a' + rand()%26;
-		base.emplace_back(unique_ptr<const char>(testStr));
+		char *testStr = base.at(i);
+		for(int j = 0; j < CHUNK_SIZE; j++) testStr[j] = 'a' + rand()%26;
 	}
 	if(argc < 3) { usage(argv[0]); return 0; }
 
-	while ((opt = getopt(argc-1, argv, "wR:r:")) != -1) {
+	ResultsOptions resultsOpts;
+	JsonValue results = makeResults("fst", argc, argv);
+	results["config"]["path"] = argv[argc-1];
+	results["config"]["files"] = NUM_FILES;
+	results["config"]["chunk_size"] = CHUNK_SIZE;
+	auto recordPhase = [&](const std::string &op, const std::vector<double> &speeds, bool failed) {
+		JsonValue phase = JsonValue::object();
+		phase["name"] = std::to_string(results["phases"].size() + 1) + ':' + op;
+		phase["metrics"] = JsonValue::object();
+		double total = 0;
+		for(auto iter : speeds) total += iter;
+		if(!speeds.empty()) phase["metrics"]["speed_MBps"] = makeMetric(total / speeds.size(), "MB/s per file", true, speeds);
+		if(failed) results["errors"].push(phase["name"].str() + " failed");
+		results["phases"].push(phase);
+	};
+
+	MetadataConfig md;
+	while ((opt = getopt_long(argc-1, argv, "wR:r:m:", longOptions, nullptr)) != -1) {
 		switch (opt) {
-			case 'w': if(write_test(argv[argc-1], base)) { cerr << "Failed write test" << endl; return 1; } break;
+			case 'w': {
+					std::vector<double> speeds;
+					bool failed = write_test(argv[argc-1], base, speeds);
+					recordPhase("write", speeds, failed);
+					if(failed) { cerr << "Failed write test" << endl; return resultsOpts.finish(results, 1); }
+				}
+				break;
 			case 'R': {
 					uint16_t fileNum = atoi(optarg);
-					if(read_file(argv[argc-1], base,fileNum)) { cerr << "Failed read file number: " << fileNum << endl; return 1; }
+					double speed = 0;
+					bool failed = read_file(argv[argc-1], base,fileNum,&speed);
+					recordPhase("readfile" + std::to_string(fileNum), failed ? std::vector<double>() : std::vector<double>(1, speed), failed);
+					if(failed) { cerr << "Failed read file number: " << fileNum << endl; return resultsOpts.finish(results, 1); }
 				}
 				break;
 			case 'r': {
 					uint16_t fileNum = atoi(optarg);
-					if(read_test(argv[argc-1], base,fileNum)) { cerr << "Failed read test" << endl; return 1; }
+					std::vector<double> speeds;
+					bool failed = read_test(argv[argc-1], base,fileNum,speeds);
+					recordPhase("read", speeds, failed);
+					if(failed) { cerr << "Failed read test" << endl; return resultsOpts.finish(results, 1); }
 				}
 				break;
+			case 'm': {
+					uint64_t files = strtoull(optarg, nullptr, 10);
+					if(files == 0) { cerr << "The metadata test needs a file count" << endl; return resultsOpts.finish(results, 1); }
+					results["config"]["md_files"] = files;
+					results["config"]["md_threads"] = md.threads;
+					results["config"]["md_fanout"] = md.fanout;
+					results["config"]["md_depth"] = md.depth;
+					std::string root = std::string(argv[argc-1]) + "/md";
+					std::vector<std::string> leaves;
+					cout << "now building a " << md.fanout << '^' << md.depth << " directory tree under " << root << "..." << endl;
+					if(!md_make_tree(root, md.fanout, md.depth, leaves)) { cerr << "Failed metadata test" << endl; return resultsOpts.finish(results, 1); }
+					bool failed = false;
+					for(int op = 0; op < MD_NUM_OPS && !failed; op++) {
+						MetadataResult res;
+						failed = !md_step(op, leaves, files, md.threads, res);
+						JsonValue phase = JsonValue::object();
+						phase["name"] = std::to_string(results["phases"].size() + 1) + ":md_" + mdOpNames[op];
+						JsonValue &metrics = phase["metrics"];
+						metrics = JsonValue::object();
+						if(failed) results["errors"].push(phase["name"].str() + " failed");
+						else {
+							double rate = files / std::max(res.seconds, 1e-6);
+							cout << mdOpNames[op] << ": " << files << " files in " << res.seconds << " s = " << rate << " ops/s, latency " << res.latency.summary() << endl;
+							metrics["ops_per_s"] = makeMetric(rate, "ops/s", true, res.threadRates);
+							metrics["latency_p50_us"] = makeMetric(res.latency.percentile(50) / 1000.0, "us", false);
+							metrics["latency_p99_us"] = makeMetric(res.latency.percentile(99) / 1000.0, "us", false);
+							metrics["latency_p99.9_us"] = makeMetric(res.latency.percentile(99.9) / 1000.0, "us", false);
+							metrics["latency_max_us"] = makeMetric(res.latency.max() / 1000.0, "us", false);
+						}
+						results["phases"].push(phase);
+					}
+					// a failed step keeps its files for a look at what went wrong
+					if(failed) { cerr << "Failed metadata test (files left under " << root << " are not removed)" << endl; return resultsOpts.finish(results, 1); }
+					md_remove_tree(root, md.fanout, md.depth);
+				}
+				break;
+			case OPT_MD_THREADS: md.threads = std::max(atoi(optarg), 1); break;
+			case OPT_MD_TREE:
+				if(sscanf(optarg, "%u:%u", &md.fanout, &md.depth) != 2 || md.fanout == 0) { cerr << "Expected <fanout>:<depth> such as 16:2: " << optarg << endl; return resultsOpts.finish(results, 1); }
+				break;
+			case OPT_JSON: case OPT_BASELINE: case OPT_TOLERANCE: resultsOpts.parse(opt, optarg); break;
+			case OPT_STAMP: stamped = true; results["config"]["stamped"] = true; break;
 			default: usage(argv[0]); break;
 		}
 	}
@@ -138,7 +336,7 @@ int main( int argc, char* argv[] ) {
 		return 1;
 	}
 
-	cout << "Test completed successfully" << endl;
-	return 0;
+	int rc = resultsOpts.finish(results, 0);
+	if(rc == 0) cout << "Test completed successfully" << endl;
+	return rc;
 }
-